@@ -0,0 +1,197 @@
+#include "allocationTracker.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+// The hooks are only built with RBTREE_TRACK_ALLOCATIONS (a CMake option), and where the allocator
+// reports block sizes
+#if defined(RBTREE_TRACK_ALLOCATIONS) && defined(__linux__) && __has_include(<malloc.h>)
+#define ALLOCATION_HOOKS 1
+#include <malloc.h>
+#elif defined(RBTREE_TRACK_ALLOCATIONS) && defined(__APPLE__)
+#define ALLOCATION_HOOKS 1
+#include <malloc/malloc.h>
+#else
+#define ALLOCATION_HOOKS 0
+#endif
+
+namespace {
+
+// Counts of one thread, only written by that thread
+// Slots are never freed: they stay in the list after their thread finished, so that its counts
+// remain in the totals (a few dozen bytes per thread that allocated while tracking).
+struct ThreadSlot {
+    std::atomic<std::int64_t> allocations{0};
+    std::atomic<std::int64_t> frees{0};
+    std::atomic<std::int64_t> allocatedBytes{0};
+    std::atomic<std::int64_t> freedBytes{0};
+    ThreadSlot* next = nullptr;
+};
+
+std::atomic<int> enabledScopes{0};
+std::atomic<ThreadSlot*> slots{nullptr}; // Every slot, newest first
+
+// Slot of the calling thread (plain pointer: no thread_local constructor runs inside operator new)
+thread_local ThreadSlot* ownSlot = nullptr;
+thread_local bool suspended = false;
+
+AllocationStats read(const ThreadSlot& slot) {
+    return {slot.allocations.load(std::memory_order_relaxed), slot.frees.load(std::memory_order_relaxed),
+            slot.allocatedBytes.load(std::memory_order_relaxed), slot.freedBytes.load(std::memory_order_relaxed)};
+}
+
+#if ALLOCATION_HOOKS
+
+void add(std::atomic<std::int64_t>& counter, std::int64_t delta) {
+    counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+// Created with malloc, so that creating a slot does not recurse into operator new (nullptr if that fails)
+ThreadSlot* threadSlot() noexcept {
+    if (!ownSlot) [[unlikely]] {
+        void* memory = std::malloc(sizeof(ThreadSlot));
+        if (!memory) return nullptr;
+        auto* slot = new (memory) ThreadSlot;
+        slot->next = slots.load(std::memory_order_relaxed);
+        while (!slots.compare_exchange_weak(slot->next, slot, std::memory_order_release, std::memory_order_relaxed)) {
+        }
+        ownSlot = slot;
+    }
+    return ownSlot;
+}
+
+bool counting() {
+    return enabledScopes.load(std::memory_order_relaxed) > 0 && !suspended;
+}
+
+size_t blockSize(void* p) {
+#if defined(__APPLE__)
+    return malloc_size(p);
+#else
+    return malloc_usable_size(p);
+#endif
+}
+
+void countAllocation(void* p) {
+    if (!p || !counting()) [[likely]] return;
+    if (ThreadSlot* slot = threadSlot()) {
+        add(slot->allocations, 1);
+        add(slot->allocatedBytes, static_cast<std::int64_t>(blockSize(p)));
+    }
+}
+
+void release(void* p) noexcept {
+    if (p && counting()) [[unlikely]] {
+        if (ThreadSlot* slot = threadSlot()) {
+            add(slot->frees, 1);
+            add(slot->freedBytes, static_cast<std::int64_t>(blockSize(p)));
+        }
+    }
+    std::free(p);
+}
+
+// malloc, or posix_memalign for over-aligned types; nullptr on failure
+void* tryAllocate(size_t size, size_t alignment) noexcept {
+    if (size == 0) size = 1;
+    if (alignment <= alignof(std::max_align_t)) return std::malloc(size);
+    void* p = nullptr;
+    return posix_memalign(&p, std::max(alignment, sizeof(void*)), size) == 0 ? p : nullptr;
+}
+
+// Allocation as operator new does it: call the new-handler until it succeeds, or throw
+void* allocate(size_t size, size_t alignment) {
+    void* p;
+    while (!(p = tryAllocate(size, alignment))) {
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) throw std::bad_alloc();
+        handler();
+    }
+    countAllocation(p);
+    return p;
+}
+
+void* allocateNoThrow(size_t size, size_t alignment) noexcept {
+    try {
+        return allocate(size, alignment);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+#endif
+
+} // namespace
+
+#if ALLOCATION_HOOKS
+
+constexpr size_t defaultAlignment = alignof(std::max_align_t);
+
+void* operator new(size_t size) { return allocate(size, defaultAlignment); }
+void* operator new[](size_t size) { return allocate(size, defaultAlignment); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return allocateNoThrow(size, defaultAlignment); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return allocateNoThrow(size, defaultAlignment); }
+void* operator new(size_t size, std::align_val_t alignment) { return allocate(size, static_cast<size_t>(alignment)); }
+void* operator new[](size_t size, std::align_val_t alignment) { return allocate(size, static_cast<size_t>(alignment)); }
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return allocateNoThrow(size, static_cast<size_t>(alignment));
+}
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return allocateNoThrow(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* p) noexcept { release(p); }
+void operator delete[](void* p) noexcept { release(p); }
+void operator delete(void* p, size_t) noexcept { release(p); }
+void operator delete[](void* p, size_t) noexcept { release(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { release(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { release(p); }
+void operator delete(void* p, std::align_val_t) noexcept { release(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { release(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { release(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { release(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { release(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { release(p); }
+
+#endif
+
+bool AllocationTracker::available() {
+    return ALLOCATION_HOOKS;
+}
+
+bool AllocationTracker::enabled() {
+    return ALLOCATION_HOOKS && enabledScopes.load(std::memory_order_relaxed) > 0;
+}
+
+AllocationStats AllocationTracker::threadStats() {
+    return ownSlot ? read(*ownSlot) : AllocationStats{};
+}
+
+AllocationStats AllocationTracker::totalStats() {
+    AllocationStats total;
+    for (const ThreadSlot* slot = slots.load(std::memory_order_acquire); slot; slot = slot->next) {
+        AllocationStats stats = read(*slot);
+        total.allocations += stats.allocations;
+        total.frees += stats.frees;
+        total.allocatedBytes += stats.allocatedBytes;
+        total.freedBytes += stats.freedBytes;
+    }
+    return total;
+}
+
+AllocationTrackingScope::AllocationTrackingScope(bool enable) : _enabled(enable) {
+    if (_enabled) enabledScopes.fetch_add(1, std::memory_order_relaxed);
+}
+
+AllocationTrackingScope::~AllocationTrackingScope() {
+    if (_enabled) enabledScopes.fetch_sub(1, std::memory_order_relaxed);
+}
+
+UntrackedAllocations::UntrackedAllocations() : _previous(suspended) {
+    suspended = true;
+}
+
+UntrackedAllocations::~UntrackedAllocations() {
+    suspended = _previous;
+}
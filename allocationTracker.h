@@ -0,0 +1,75 @@
+#ifndef ALLOCATION_TRACKER_H
+#define ALLOCATION_TRACKER_H
+
+#include <cstdint>
+
+// Opt-in accounting of heap allocations
+// Built with the CMake option RBTREE_TRACK_ALLOCATIONS, this module replaces the global operator
+// new and delete (every form: arrays, nothrow, aligned and sized) with versions that forward to
+// malloc and free and, while tracking is enabled, count the allocations, frees and bytes of the
+// calling thread. Bytes are the sizes of the blocks the allocator
+// hands out (malloc_usable_size), so that a block counts the same when allocated and when freed.
+// Only operator new is seen: the slabs of a NodeArena are counted, the nodes placed in them are not.
+// Counts are kept per thread, written without atomic read-modify-writes and summed when read.
+// While tracking is disabled, an allocation costs one more load and branch predicted not taken.
+// Without the option, or where the allocator cannot report block sizes, operator new is left alone
+// and nothing is counted (see available()).
+
+// Allocation counts, since tracking started or between two snapshots
+struct AllocationStats {
+    std::int64_t allocations = 0;
+    std::int64_t frees = 0;
+    std::int64_t allocatedBytes = 0;
+    std::int64_t freedBytes = 0;
+
+    // Net growth of the heap: bytes allocated and not freed (negative if more was freed)
+    std::int64_t liveBytes() const { return allocatedBytes - freedBytes; }
+
+    AllocationStats operator-(const AllocationStats& before) const {
+        return {allocations - before.allocations, frees - before.frees, allocatedBytes - before.allocatedBytes,
+                freedBytes - before.freedBytes};
+    }
+};
+
+class AllocationTracker {
+public:
+    // Whether the hooks are installed on this platform
+    static bool available();
+
+    // Whether allocations are being counted (see AllocationTrackingScope)
+    static bool enabled();
+
+    // Counts of the calling thread, and of all threads (including finished ones)
+    static AllocationStats threadStats();
+    static AllocationStats totalStats();
+};
+
+// Counts allocations for its lifetime (scopes may nest and overlap across threads)
+class AllocationTrackingScope {
+public:
+    // Constructor: with enable false, the scope does nothing
+    explicit AllocationTrackingScope(bool enable = true);
+    ~AllocationTrackingScope();
+
+    AllocationTrackingScope(AllocationTrackingScope const&) = delete;
+    AllocationTrackingScope& operator=(AllocationTrackingScope const&) = delete;
+
+private:
+    bool _enabled;
+};
+
+// Leaves the allocations of the calling thread uncounted for its lifetime (bookkeeping of the
+// instrumentation itself)
+class UntrackedAllocations {
+public:
+    UntrackedAllocations();
+    ~UntrackedAllocations();
+
+    UntrackedAllocations(UntrackedAllocations const&) = delete;
+    UntrackedAllocations& operator=(UntrackedAllocations const&) = delete;
+
+private:
+    bool _previous;
+};
+
+#endif // ALLOCATION_TRACKER_H
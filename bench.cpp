@@ -0,0 +1,295 @@
+// Micro-benchmarks of the tree and tokenizer primitives (the `bench` target)
+// Usage: bench [--words N] [--warmup N] [--reps N] [--filter TEXT] [--out FILE] [--allocations] [--perf]
+//              [--workers N,N,...] [--input FILE | --corpus-bytes N]
+// Progress goes to stderr, the results to stdout (or FILE) as one JSON object.
+#include "benchHarness.h"
+#include "header.h"
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Random lowercase word of 2 to 12 letters, occasionally with an inner apostrophe
+std::string randomWord(std::mt19937_64& gen) {
+    std::uniform_int_distribution<int> length(2, 12), letter('a', 'z'), apostrophe(0, 15);
+    std::string word;
+    for (int i = length(gen); i > 0; --i) word += static_cast<char>(letter(gen));
+    if (apostrophe(gen) == 0) word.insert(word.size() - 1, 1, '\'');
+    return word;
+}
+
+// Append a word to a text, with mixed case, punctuation and quotes as in real prose
+void appendWord(std::string& text, const std::string& word, std::mt19937_64& gen) {
+    std::uniform_int_distribution<int> pick(0, 19);
+    int style = pick(gen);
+    if (style == 0) {
+        text += "'" + word + "' ";
+    } else if (style == 1) {
+        text += static_cast<char>(word[0] - 'a' + 'A');
+        text.append(word, 1);
+        text += ", ";
+    } else {
+        text += word;
+        text += style == 2 ? ".\n" : " ";
+    }
+}
+
+// Text of the given words
+std::string makeText(const std::vector<std::string>& words, std::mt19937_64& gen) {
+    std::string text;
+    for (const auto& word : words) appendWord(text, word, gen);
+    return text;
+}
+
+// Text of about the given size, of words drawn at random from a vocabulary (e.g. a 1 GB corpus)
+std::string makeCorpus(const std::vector<std::string>& vocabulary, size_t bytes, std::mt19937_64& gen) {
+    std::uniform_int_distribution<size_t> pickWord(0, vocabulary.size() - 1);
+    std::string text;
+    text.reserve(bytes + 64);
+    while (text.size() < bytes) appendWord(text, vocabulary[pickWord(gen)], gen);
+    return text;
+}
+
+// Value of the option following argument i, as a number
+size_t numberArgument(int argc, char** argv, int& i) {
+    if (i + 1 >= argc) throw std::invalid_argument(std::string("Missing value for ") + argv[i]);
+    return static_cast<size_t>(std::stoull(argv[++i]));
+}
+
+// Value of the option following argument i
+std::string stringArgument(int argc, char** argv, int& i) {
+    if (i + 1 >= argc) throw std::invalid_argument(std::string("Missing value for ") + argv[i]);
+    return argv[++i];
+}
+
+// Value of the option following argument i, as a comma-separated list of positive numbers
+std::vector<unsigned> listArgument(int argc, char** argv, int& i) {
+    std::string list = stringArgument(argc, argv, i);
+    std::vector<unsigned> numbers;
+    for (size_t start = 0; start <= list.size();) {
+        size_t end = std::min(list.find(',', start), list.size());
+        unsigned number = static_cast<unsigned>(std::stoul(list.substr(start, end - start)));
+        if (number == 0) throw std::invalid_argument("Worker counts must be positive: " + list);
+        numbers.push_back(number);
+        start = end + 1;
+    }
+    return numbers;
+}
+
+// 1, 2, 4, ... up to the number of hardware threads, and that number
+std::vector<unsigned> defaultWorkerCounts() {
+    unsigned hardware = std::max(std::thread::hardware_concurrency(), 1u);
+    std::vector<unsigned> counts;
+    for (unsigned count = 1; count < hardware; count *= 2) counts.push_back(count);
+    counts.push_back(hardware);
+    return counts;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+    size_t wordCount = 200000;
+    std::string outputPath;
+    std::vector<unsigned> workerCounts = defaultWorkerCounts();
+    std::string inputFile;
+    size_t corpusBytes = 0;
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--words") {
+                wordCount = std::max<size_t>(numberArgument(argc, argv, i), 2);
+            } else if (arg == "--warmup") {
+                options.warmup = numberArgument(argc, argv, i);
+            } else if (arg == "--reps") {
+                options.repetitions = numberArgument(argc, argv, i);
+            } else if (arg == "--filter") {
+                options.filter = stringArgument(argc, argv, i);
+            } else if (arg == "--out") {
+                outputPath = stringArgument(argc, argv, i);
+            } else if (arg == "--allocations") {
+                options.trackAllocations = true;
+            } else if (arg == "--perf") {
+                options.hardwareCounters = true;
+            } else if (arg == "--workers") {
+                workerCounts = listArgument(argc, argv, i);
+            } else if (arg == "--input") {
+                inputFile = stringArgument(argc, argv, i);
+            } else if (arg == "--corpus-bytes") {
+                corpusBytes = numberArgument(argc, argv, i);
+            } else {
+                throw std::invalid_argument("Unknown argument: " + arg);
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\nUsage: " << argv[0]
+                  << " [--words N] [--warmup N] [--reps N] [--filter TEXT] [--out FILE] [--allocations] [--perf]"
+                  << " [--workers N,N,...] [--input FILE | --corpus-bytes N]\n";
+        return 2;
+    }
+
+    // Enough pool workers for the largest count (the forking thread is the last one), even beyond
+    // the hardware threads, so that every count runs with that many threads
+    const unsigned maxWorkers = *std::max_element(workerCounts.begin(), workerCounts.end());
+    ThreadPool::setGlobalWorkerCount(std::max(maxWorkers - 1, ThreadPool::defaultWorkerCount()));
+
+    // Inputs, the same for every run (fixed seed)
+    std::mt19937_64 gen(42);
+    std::vector<std::string> randomKeys(wordCount);
+    for (auto& word : randomKeys) word = randomWord(gen);
+    std::vector<std::string> sortedKeys = randomKeys;
+    std::sort(sortedKeys.begin(), sortedKeys.end());
+    std::vector<std::string> vocabulary(256);
+    for (auto& word : vocabulary) word = randomWord(gen);
+    std::vector<std::string> duplicateKeys(wordCount);
+    std::uniform_int_distribution<size_t> pickWord(0, vocabulary.size() - 1);
+    for (auto& word : duplicateKeys) word = vocabulary[pickWord(gen)];
+    const std::string text = makeText(randomKeys, gen);
+    std::vector<std::string> quotedWords(wordCount);
+    for (size_t i = 0; i < wordCount; ++i) quotedWords[i] = (i % 2 ? "'" : "") + randomKeys[i] + "''";
+
+    // Corpus of the scaling cases: a file (e.g. the bundled text), a synthetic text of the given
+    // size over the random words, or the generated text
+    std::string corpusText = text;
+    std::string corpusName = "generated";
+    if (!inputFile.empty()) {
+        try {
+            corpusText = readFile(inputFile);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        corpusName = inputFile;
+    } else if (corpusBytes) {
+        corpusText = makeCorpus(randomKeys, corpusBytes, gen);
+        corpusName = "synthetic";
+    }
+    const TokenizedText corpus = tokenizeViews(corpusText);
+
+    const auto scratch = std::filesystem::temp_directory_path();
+    const std::string inputPath = (scratch / "bench_input.txt").string();
+    const std::string outputFile = (scratch / "bench_output.txt").string();
+    {
+        std::ofstream input(inputPath, std::ios::binary);
+        input << text;
+    }
+
+    using Tree = RBTree<std::string>;
+    // The same tree with non-atomic reference counts, to compare the two policies alone
+    using LocalTree = RBTree<std::string, std::allocator<std::string>, LocalRefCount>;
+    auto insertAll = [](auto empty, const std::vector<std::string>& keys) {
+        return [empty, &keys]() {
+            auto tree = empty;
+            for (const auto& key : keys) tree = tree.insert(key);
+            doNotOptimize(tree);
+        };
+    };
+    // The tree of the processing pipeline: arena nodes, plain reference counts, keys inserted as views
+    auto insertViews = [](const std::vector<std::string>& keys) {
+        return [&keys]() {
+            WordTree tree;
+            for (const auto& key : keys) tree = tree.insert(std::string_view(key));
+            doNotOptimize(tree);
+        };
+    };
+    auto buildFrom = [](auto first, auto last) {
+        Tree tree;
+        for (; first != last; ++first) tree = tree.insert(*first);
+        return tree;
+    };
+    const Tree randomTree = buildFrom(randomKeys.begin(), randomKeys.end());
+    const Tree leftHalf = buildFrom(randomKeys.begin(), randomKeys.begin() + wordCount / 2);
+    const Tree rightHalf = buildFrom(randomKeys.begin() + wordCount / 2, randomKeys.end());
+
+    BenchSuite suite(options);
+    suite.run("RBTree::insert/random", wordCount, "word", insertAll(Tree(), randomKeys));
+    suite.run("RBTree::insert/sorted", wordCount, "word", insertAll(Tree(), sortedKeys));
+    suite.run("RBTree::insert/duplicates", wordCount, "word", insertAll(Tree(), duplicateKeys));
+    suite.run("RBTree<LocalRefCount>::insert/random", wordCount, "word", insertAll(LocalTree(), randomKeys));
+    suite.run("RBTree<LocalRefCount>::insert/sorted", wordCount, "word", insertAll(LocalTree(), sortedKeys));
+    suite.run("RBTree<LocalRefCount>::insert/duplicates", wordCount, "word", insertAll(LocalTree(), duplicateKeys));
+    suite.run("WordTree::insert/random", wordCount, "word", insertViews(randomKeys));
+    suite.run("WordTree::insert/sorted", wordCount, "word", insertViews(sortedKeys));
+    suite.run("WordTree::insert/duplicates", wordCount, "word", insertViews(duplicateKeys));
+    // Scaling of the parallel builds with the number of workers, on the corpus
+    for (unsigned workers : workerCounts) {
+        const auto& words = corpus.words;
+        suite.run("parallelInsert/" + std::to_string(workers), words.size(), "word", [&]() {
+            doNotOptimize(parallelInsertRange<WordTree>(words.begin(), words.end(), workers));
+        });
+        suite.run("rangePartitionedInsert/" + std::to_string(workers), words.size(), "word", [&]() {
+            doNotOptimize(rangePartitionedInsertRange<WordTree>(words.begin(), words.end(), workers));
+        });
+    }
+    suite.run("RBTree::getSortedValues", randomTree.getSortedValues().size(), "word", [&]() {
+        doNotOptimize(randomTree.getSortedValues());
+    });
+    suite.run("mergeTrees", wordCount, "word", [&]() {
+        doNotOptimize(mergeTrees(leftHalf, rightHalf));
+    });
+    suite.run("tokenize", text.size(), "byte", [&]() {
+        doNotOptimize(tokenize(text));
+    });
+    suite.run("tokenizeViews", text.size(), "byte", [&]() {
+        doNotOptimize(tokenizeViews(text));
+    });
+    // Every kernel the CPU supports (higher levels would fall back to the detected one)
+    for (auto level : {SimdLevel::Scalar, SimdLevel::SSE2, SimdLevel::AVX2, SimdLevel::AVX512}) {
+        if (level > detectSimdLevel()) break;
+        suite.run("tokenizeViews/" + std::string(simdLevelName(level)), text.size(), "byte", [&]() {
+            doNotOptimize(tokenizeViews(text, level));
+        });
+    }
+    suite.run("parallelTokenize", text.size(), "byte", [&]() {
+        doNotOptimize(parallelTokenize(text));
+    });
+    suite.run("trimApostrophes", wordCount, "word", [&]() {
+        for (const auto& word : quotedWords) doNotOptimize(trimApostrophes(word));
+    });
+    suite.run("readFile", text.size(), "byte", [&]() {
+        doNotOptimize(readFile(inputPath));
+    });
+    suite.run("writeToFile", sortedKeys.size(), "word", [&]() {
+        writeToFile(outputFile, sortedKeys);
+    });
+
+    std::filesystem::remove(inputPath);
+    std::filesystem::remove(outputFile);
+
+    // Results, with what is needed to compare runs
+#ifdef __OPTIMIZE__
+    const bool optimized = true;
+#else
+    const bool optimized = false;
+#endif
+    std::vector<std::pair<std::string, std::string>> context = {
+        {"words", std::to_string(wordCount)},
+        {"text_bytes", std::to_string(text.size())},
+        {"corpus", jsonString(corpusName)},
+        {"corpus_words", std::to_string(corpus.words.size())},
+        {"pool_workers", std::to_string(ThreadPool::global().workerCount())},
+        {"hardware_threads", std::to_string(std::thread::hardware_concurrency())},
+        {"simd", jsonString(simdLevelName(detectSimdLevel()))},
+        {"optimized", optimized ? "true" : "false"},
+#ifdef __VERSION__
+        {"compiler", jsonString(__VERSION__)},
+#endif
+    };
+    if (outputPath.empty()) {
+        suite.writeJson(std::cout, context);
+    } else {
+        std::ofstream out(outputPath);
+        suite.writeJson(out, context);
+        if (!out) {
+            std::cerr << "Failed to write " << outputPath << "\n";
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,197 @@
+#ifndef BENCH_HARNESS_H
+#define BENCH_HARNESS_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <numeric>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "allocationTracker.h"
+#include "metrics.h"
+#include "perfCounters.h"
+
+// Minimal micro-benchmark harness (no external dependencies)
+// A case is a function running one repetition of the measured work. Every case is run a few
+// times untimed (warmup: caches, page faults, allocator and thread pool start-up), then timed
+// over a number of repetitions with steady_clock. The summary keeps the minimum (the least
+// disturbed run), the median (the typical run) and the 99th percentile (the tail), each also
+// divided by the number of operations one repetition performs.
+// Optionally, one more untimed repetition counts the heap allocations a repetition makes (see
+// AllocationTracker), so that the hooks do not disturb the timings. Hardware counters (see
+// PerfCounters) can also be read around the timed repetitions, and reported per operation.
+
+// Keep the compiler from optimizing away a computed value
+template <typename T>
+inline void doNotOptimize(T const& value) {
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "r,m"(value) : "memory");
+#else
+    static volatile const void* sink;
+    sink = &value;
+#endif
+}
+
+// Settings shared by all cases of a run
+struct BenchOptions {
+    size_t warmup = 2; // Untimed repetitions before measuring
+    size_t repetitions = 15; // Timed repetitions
+    std::string filter; // Only run cases whose name contains this (all if empty)
+    bool trackAllocations = false; // Count the allocations of one repetition
+    bool hardwareCounters = false; // Read hardware performance counters around the timed repetitions
+};
+
+// Timing summary of one case
+struct BenchResult {
+    std::string name;
+    size_t opsPerRepetition = 0; // Operations performed by one repetition
+    std::string unit; // What one operation is (a word, a byte, ...)
+    std::vector<double> samplesNs; // Duration of every timed repetition, sorted
+    double minNs = 0;
+    double medianNs = 0;
+    double p99Ns = 0;
+    double meanNs = 0;
+    std::optional<AllocationStats> allocations; // Allocations of one repetition, if tracked
+    std::optional<PerfReading> hardware; // Hardware counts of one repetition (mean of the timed ones), if read
+
+    // Duration (or any amount) of a repetition divided by its number of operations
+    double nsPerOp(double repetitionNs) const {
+        return opsPerRepetition ? repetitionNs / static_cast<double>(opsPerRepetition) : repetitionNs;
+    }
+};
+
+// Runs benchmark cases and reports their results
+class BenchSuite {
+public:
+    explicit BenchSuite(BenchOptions options) : _options(std::move(options)) {}
+
+    // Benchmark `repetition`, which performs `opsPerRepetition` operations of the given unit per call
+    // Returns false if the case is filtered out
+    template <typename F>
+    bool run(const std::string& name, size_t opsPerRepetition, const std::string& unit, F&& repetition) {
+        if (!_options.filter.empty() && name.find(_options.filter) == std::string::npos) return false;
+
+        for (size_t i = 0; i < _options.warmup; ++i) repetition();
+
+        BenchResult result;
+        result.name = name;
+        result.opsPerRepetition = opsPerRepetition;
+        result.unit = unit;
+        std::optional<PerfCounters> counters; // Opened after the warmup, which may have started threads
+        if (_options.hardwareCounters) {
+            counters.emplace();
+            if (!counters->error().empty() && !_reportedCounterError) {
+                std::cerr << "Hardware counters unavailable: " << counters->error() << "\n";
+                _reportedCounterError = true;
+            }
+            if (!counters->available()) counters.reset();
+        }
+        const PerfReading countsBefore = counters ? counters->read() : PerfReading{};
+        const size_t repetitions = std::max<size_t>(_options.repetitions, 1);
+        for (size_t i = 0; i < repetitions; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            repetition();
+            auto stop = std::chrono::steady_clock::now();
+            result.samplesNs.push_back(std::chrono::duration<double, std::nano>(stop - start).count());
+        }
+        if (counters) result.hardware = (counters->read() - countsBefore) / static_cast<double>(repetitions);
+        summarize(result);
+        if (_options.trackAllocations && AllocationTracker::available()) {
+            AllocationTrackingScope tracking;
+            AllocationStats before = AllocationTracker::totalStats();
+            repetition();
+            result.allocations = AllocationTracker::totalStats() - before;
+        }
+
+        std::cerr << name << ": median " << result.medianNs / 1e6 << " ms, "
+                  << result.nsPerOp(result.medianNs) << " ns/" << unit;
+        if (result.allocations) {
+            std::cerr << ", " << result.nsPerOp(static_cast<double>(result.allocations->allocations))
+                      << " allocations/" << unit;
+        }
+        if (result.hardware) {
+            if (auto ipc = result.hardware->ipc()) std::cerr << ", IPC " << *ipc;
+            if (result.hardware->has(PerfEvent::LlcMisses)) {
+                std::cerr << ", " << result.nsPerOp((*result.hardware)[PerfEvent::LlcMisses]) << " LLC misses/" << unit;
+            }
+            if (result.hardware->partial) std::cerr << " (partial: threads were running)";
+        }
+        std::cerr << "\n";
+        _results.push_back(std::move(result));
+        return true;
+    }
+
+    // Results of the cases run so far
+    const std::vector<BenchResult>& results() const { return _results; }
+
+    // Write the results as one JSON object, with `context` (pairs of name and preformatted JSON value)
+    void writeJson(std::ostream& out, const std::vector<std::pair<std::string, std::string>>& context) const {
+        out << "{\n  \"context\": {";
+        for (size_t i = 0; i < context.size(); ++i) {
+            out << (i ? ", " : "") << jsonString(context[i].first) << ": " << context[i].second;
+        }
+        out << "},\n  \"warmup\": " << _options.warmup << ",\n  \"repetitions\": " << _options.repetitions
+            << ",\n  \"benchmarks\": [";
+        for (size_t i = 0; i < _results.size(); ++i) {
+            const BenchResult& r = _results[i];
+            out << (i ? "," : "") << "\n    {\"name\": " << jsonString(r.name)
+                << ", \"ops_per_rep\": " << r.opsPerRepetition << ", \"op_unit\": " << jsonString(r.unit)
+                << ", \"min_ns\": " << jsonNumber(r.minNs)
+                << ", \"median_ns\": " << jsonNumber(r.medianNs)
+                << ", \"p99_ns\": " << jsonNumber(r.p99Ns)
+                << ", \"mean_ns\": " << jsonNumber(r.meanNs)
+                << ", \"min_ns_per_op\": " << jsonNumber(r.nsPerOp(r.minNs))
+                << ", \"median_ns_per_op\": " << jsonNumber(r.nsPerOp(r.medianNs))
+                << ", \"p99_ns_per_op\": " << jsonNumber(r.nsPerOp(r.p99Ns));
+            if (r.allocations) {
+                out << ", \"allocations_per_rep\": " << r.allocations->allocations
+                    << ", \"allocated_bytes_per_rep\": " << r.allocations->allocatedBytes
+                    << ", \"live_bytes_per_rep\": " << r.allocations->liveBytes()
+                    << ", \"allocations_per_op\": " << jsonNumber(r.nsPerOp(static_cast<double>(r.allocations->allocations)))
+                    << ", \"allocated_bytes_per_op\": "
+                    << jsonNumber(r.nsPerOp(static_cast<double>(r.allocations->allocatedBytes)));
+            }
+            if (r.hardware && !r.hardware->empty()) {
+                const char* separator = "";
+                out << ", \"hardware_per_op\": {";
+                for (size_t e = 0; e < perfEventCount; ++e) {
+                    auto event = static_cast<PerfEvent>(e);
+                    if (!r.hardware->has(event)) continue;
+                    out << separator << "\"" << perfEventName(event) << "\": " << jsonNumber(r.nsPerOp((*r.hardware)[event]));
+                    separator = ", ";
+                }
+                out << "}";
+                if (auto ipc = r.hardware->ipc()) out << ", \"ipc\": " << jsonNumber(*ipc);
+                if (r.hardware->partial) out << ", \"hardware_partial\": true";
+            }
+            out << "}";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+private:
+    // Order statistics of the samples (nearest-rank percentiles)
+    static void summarize(BenchResult& result) {
+        auto& samples = result.samplesNs;
+        std::sort(samples.begin(), samples.end());
+        auto rank = [&](double q) {
+            size_t index = static_cast<size_t>(std::ceil(q * static_cast<double>(samples.size())));
+            return samples[std::clamp<size_t>(index, 1, samples.size()) - 1];
+        };
+        result.minNs = samples.front();
+        result.medianNs = rank(0.5);
+        result.p99Ns = rank(0.99);
+        result.meanNs = std::accumulate(samples.begin(), samples.end(), 0.0) / static_cast<double>(samples.size());
+    }
+
+    BenchOptions _options;
+    std::vector<BenchResult> _results;
+    bool _reportedCounterError = false;
+};
+
+#endif // BENCH_HARNESS_H
@@ -0,0 +1,226 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+
+// Occupancy and stall metrics of a BoundedQueue
+struct QueueStats {
+    size_t capacity = 0; // Number of slots
+    size_t pushes = 0; // Number of items pushed
+    size_t maxOccupancy = 0; // Largest number of items in the queue right after a push
+    double meanOccupancy = 0; // Average number of items in the queue right after a push
+    std::uint64_t pushStallNs = 0; // Time producers waited for a free slot (backpressure)
+    std::uint64_t popStallNs = 0; // Time consumers waited for an item
+};
+
+// Bounded lock-free queue for any number of producers and consumers
+// Every slot carries a sequence number telling whether it is ready to be written or read for the
+// current lap, so producers and consumers only contend on their own position counter (D. Vyukov's
+// bounded queue). push and pop block when the queue is full or empty, which gives backpressure to
+// fast producers: they retry for a few yields, then sleep on a condition variable until the other
+// side frees a slot or publishes an item. The mutex is only taken by threads going to sleep and by
+// those waking them; the time spent waiting is recorded in the statistics.
+// close() ends the stream: consumers then drain the remaining items and pop returns false, and
+// producers still waiting for room give up (push returns false), so that a pipeline can be torn
+// down while its stages are blocked.
+template<typename T>
+class BoundedQueue {
+public:
+    // Constructor: the capacity is rounded up to a power of two
+    explicit BoundedQueue(size_t capacity)
+        : _mask(std::bit_ceil(std::max<size_t>(capacity, 2)) - 1), _cells(new Cell[_mask + 1]) {
+        for (size_t i = 0; i <= _mask; ++i) _cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    BoundedQueue(BoundedQueue const &) = delete;
+    BoundedQueue &operator=(BoundedQueue const &) = delete;
+
+    // Push without waiting; the item is only moved from if there was room for it
+    bool tryPush(T &&item) {
+        size_t pos = _tail.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true) {
+            cell = &_cells[pos & _mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto lap = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos);
+            if (lap == 0) { // Slot free for this position: claim it
+                if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (lap < 0) {
+                return false; // Full: the slot still holds the item of the previous lap
+            } else {
+                pos = _tail.load(std::memory_order_relaxed); // Another producer claimed it
+            }
+        }
+        cell->value = std::move(item);
+        cell->sequence.store(pos + 1, std::memory_order_release); // Publish to consumers
+        recordPush(pos + 1);
+        wake(_waitingConsumers, _notEmpty);
+        return true;
+    }
+
+    // Pop without waiting
+    bool tryPop(T &item) {
+        size_t pos = _head.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true) {
+            cell = &_cells[pos & _mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto lap = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos + 1);
+            if (lap == 0) { // Item published for this position: claim it
+                if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (lap < 0) {
+                return false; // Empty
+            } else {
+                pos = _head.load(std::memory_order_relaxed); // Another consumer claimed it
+            }
+        }
+        item = std::move(cell->value);
+        cell->sequence.store(pos + _mask + 1, std::memory_order_release); // Free the slot for the next lap
+        wake(_waitingProducers, _notFull);
+        return true;
+    }
+
+    // Push, waiting while the queue is full; returns false (dropping the item) if the queue was
+    // closed while waiting
+    bool push(T item) {
+        if (tryPush(std::move(item))) return true;
+        auto start = std::chrono::steady_clock::now();
+        bool pushed = waitUntil(_waitingProducers, _notFull, [&]() -> std::optional<bool> {
+            if (tryPush(std::move(item))) return true;
+            if (_closed.load(std::memory_order_acquire)) return false;
+            return std::nullopt;
+        });
+        _pushStallNs.fetch_add(elapsedNs(start), std::memory_order_relaxed);
+        return pushed;
+    }
+
+    // Pop, waiting while the queue is empty; returns false once the queue is closed and drained
+    bool pop(T &item) {
+        if (tryPop(item)) return true;
+        auto start = std::chrono::steady_clock::now();
+        bool popped = waitUntil(_waitingConsumers, _notEmpty, [&]() -> std::optional<bool> {
+            if (tryPop(item)) return true;
+            if (_closed.load(std::memory_order_acquire)) return tryPop(item); // Recheck after close
+            return std::nullopt;
+        });
+        _popStallNs.fetch_add(elapsedNs(start), std::memory_order_relaxed);
+        return popped;
+    }
+
+    // Signal that no more items will be pushed (or, to abort, that nobody will pop them)
+    void close() {
+        _closed.store(true, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> guard(_waitLock);
+            _wakeups.fetch_add(1, std::memory_order_release);
+        }
+        _notFull.notify_all();
+        _notEmpty.notify_all();
+    }
+
+    // Number of slots
+    size_t capacity() const { return _mask + 1; }
+
+    // Snapshot of the metrics (exact once producers and consumers are done)
+    QueueStats stats() const {
+        QueueStats result;
+        result.capacity = capacity();
+        result.pushes = _pushes.load(std::memory_order_relaxed);
+        result.maxOccupancy = _maxOccupancy.load(std::memory_order_relaxed);
+        result.meanOccupancy = result.pushes
+            ? static_cast<double>(_occupancySum.load(std::memory_order_relaxed)) / static_cast<double>(result.pushes) : 0;
+        result.pushStallNs = _pushStallNs.load(std::memory_order_relaxed);
+        result.popStallNs = _popStallNs.load(std::memory_order_relaxed);
+        return result;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence; // Position this slot is ready for (see tryPush and tryPop)
+        T value;
+    };
+
+    static std::uint64_t elapsedNs(std::chrono::steady_clock::time_point start) {
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+    }
+
+    // Retry attempt (which returns the result once there is one) until it succeeds or fails: spin
+    // briefly, since the other side is usually about to make progress, then sleep until woken.
+    // attempt runs without the lock, since succeeding wakes the other side (see wake).
+    template<typename Attempt>
+    bool waitUntil(std::atomic<unsigned> &waiting, std::condition_variable &condition, Attempt attempt) {
+        for (int spin = 0; spin < spinLimit; ++spin) {
+            if (std::optional<bool> result = attempt()) return *result;
+            std::this_thread::yield();
+        }
+        // Announce the waiter before retrying: a thread making progress after a failed retry sees
+        // it, and bumps _wakeups before notifying, so the wakeup is not lost
+        waiting.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::optional<bool> result;
+        while (true) {
+            std::uint64_t wakeups = _wakeups.load(std::memory_order_acquire);
+            if ((result = attempt())) break;
+            std::unique_lock<std::mutex> lock(_waitLock);
+            condition.wait(lock, [&]() { return _wakeups.load(std::memory_order_relaxed) != wakeups; });
+        }
+        waiting.fetch_sub(1, std::memory_order_relaxed);
+        return *result;
+    }
+
+    // Wake the threads sleeping on condition, if any (after publishing an item or freeing a slot)
+    void wake(std::atomic<unsigned> &waiting, std::condition_variable &condition) {
+        std::atomic_thread_fence(std::memory_order_seq_cst); // Pairs with the fence in waitUntil
+        if (waiting.load(std::memory_order_relaxed) == 0) [[likely]] return;
+        {
+            std::lock_guard<std::mutex> guard(_waitLock);
+            _wakeups.fetch_add(1, std::memory_order_release);
+        }
+        condition.notify_all();
+    }
+
+    // Sample the occupancy right after the push that ended at position tail
+    void recordPush(size_t tail) {
+        size_t head = _head.load(std::memory_order_relaxed);
+        size_t occupancy = std::min(tail > head ? tail - head : 0, capacity());
+        _pushes.fetch_add(1, std::memory_order_relaxed);
+        _occupancySum.fetch_add(occupancy, std::memory_order_relaxed);
+        size_t max = _maxOccupancy.load(std::memory_order_relaxed);
+        while (occupancy > max && !_maxOccupancy.compare_exchange_weak(max, occupancy, std::memory_order_relaxed)) {
+        }
+    }
+
+    const size_t _mask; // Capacity - 1
+    std::unique_ptr<Cell[]> _cells; // Ring of slots
+    alignas(64) std::atomic<size_t> _tail{0}; // Next position to push (own cache line for producers)
+    alignas(64) std::atomic<size_t> _head{0}; // Next position to pop (own cache line for consumers)
+    alignas(64) std::atomic<bool> _closed{false};
+    std::atomic<size_t> _pushes{0};
+    std::atomic<size_t> _occupancySum{0};
+    std::atomic<size_t> _maxOccupancy{0};
+    std::atomic<std::uint64_t> _pushStallNs{0};
+    std::atomic<std::uint64_t> _popStallNs{0};
+
+    // Sleeping producers and consumers (see waitUntil)
+    static constexpr int spinLimit = 64;
+    std::mutex _waitLock;
+    std::condition_variable _notFull;
+    std::condition_variable _notEmpty;
+    std::atomic<unsigned> _waitingProducers{0};
+    std::atomic<unsigned> _waitingConsumers{0};
+    std::atomic<std::uint64_t> _wakeups{0}; // Bumped under the lock by every wake and close
+};
+
+#endif // BOUNDED_QUEUE_H
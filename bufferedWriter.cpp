@@ -0,0 +1,143 @@
+#include "bufferedWriter.h"
+#include <algorithm>
+#include <cerrno>
+#include <new>
+#include <utility>
+
+#if __has_include(<sys/uio.h>)
+#define BUFFERED_WRITER_POSIX 1
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#else
+#define BUFFERED_WRITER_POSIX 0
+#endif
+
+namespace {
+
+constexpr std::align_val_t pageAlignment{4096};
+
+} // namespace
+
+void BufferedWriter::AlignedDelete::operator()(char* p) const {
+    ::operator delete[](p, pageAlignment);
+}
+
+BufferedWriter::BufferedWriter(const std::string& filePath, size_t bufferBytes)
+    : _filePath(filePath), _capacity(std::max<size_t>(bufferBytes, 1)) {
+    _buffer.reset(static_cast<char*>(::operator new[](_capacity, pageAlignment)));
+#if BUFFERED_WRITER_POSIX
+    _fd = ::open(filePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (_fd < 0) {
+        throw std::ios_base::failure("Failed to open file: " + filePath);
+    }
+#else
+    _stream = std::make_unique<std::ofstream>(filePath, std::ios::out | std::ios::trunc | std::ios::binary);
+    if (!_stream->is_open()) {
+        throw std::ios_base::failure("Failed to open file: " + filePath);
+    }
+#endif
+}
+
+BufferedWriter::~BufferedWriter() {
+    try {
+        close();
+    } catch (...) {
+        // Errors can only be reported by an explicit close()
+    }
+}
+
+void BufferedWriter::appendSlow(std::string_view bytes, bool newline) {
+    size_t needed = bytes.size() + (newline ? 1 : 0);
+    if (needed > _capacity) {
+        // Too large to ever be buffered: write it right behind the buffered bytes
+        writeOut(bytes);
+        if (newline) append("\n");
+        return;
+    }
+    flush();
+    std::memcpy(_buffer.get(), bytes.data(), bytes.size());
+    if (newline) _buffer[bytes.size()] = '\n';
+    _used = needed;
+}
+
+void BufferedWriter::flush() {
+    if (_used > 0) writeOut({});
+}
+
+void BufferedWriter::writeOut(std::string_view extra) {
+    size_t total = _used + extra.size();
+#if BUFFERED_WRITER_POSIX
+    if (_fd < 0) {
+        throw std::ios_base::failure("File already closed: " + _filePath);
+    }
+    iovec parts[2] = {{_buffer.get(), _used}, {const_cast<char*>(extra.data()), extra.size()}};
+    iovec* part = parts;
+    int count = 2;
+    while (count > 0) {
+        if (part->iov_len == 0) { // Nothing (left) in this part
+            ++part;
+            --count;
+            continue;
+        }
+        ssize_t written = ::writev(_fd, part, count);
+        ++_writeCalls;
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            throw std::ios_base::failure("Failed to write file: " + _filePath);
+        }
+        // Skip what a partial write did write
+        for (auto left = static_cast<size_t>(written); left > 0;) {
+            size_t step = std::min(left, part->iov_len);
+            part->iov_base = static_cast<char*>(part->iov_base) + step;
+            part->iov_len -= step;
+            left -= step;
+            if (part->iov_len == 0) {
+                ++part;
+                --count;
+            }
+        }
+    }
+#else
+    if (!_stream) {
+        throw std::ios_base::failure("File already closed: " + _filePath);
+    }
+    _stream->write(_buffer.get(), static_cast<std::streamsize>(_used));
+    _stream->write(extra.data(), static_cast<std::streamsize>(extra.size()));
+    _writeCalls += extra.empty() ? 1 : 2;
+    if (!*_stream) {
+        throw std::ios_base::failure("Failed to write file: " + _filePath);
+    }
+#endif
+    _flushed += total;
+    _used = 0;
+}
+
+void BufferedWriter::close() {
+#if BUFFERED_WRITER_POSIX
+    if (_fd < 0) return;
+    try {
+        flush();
+    } catch (...) {
+        ::close(std::exchange(_fd, -1));
+        throw;
+    }
+    if (::close(std::exchange(_fd, -1)) != 0) {
+        throw std::ios_base::failure("Failed to close file: " + _filePath);
+    }
+#else
+    if (!_stream) return;
+    try {
+        flush();
+    } catch (...) {
+        _stream.reset();
+        throw;
+    }
+    _stream->close();
+    bool failed = _stream->fail();
+    _stream.reset();
+    if (failed) {
+        throw std::ios_base::failure("Failed to close file: " + _filePath);
+    }
+#endif
+}
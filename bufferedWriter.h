@@ -0,0 +1,83 @@
+#ifndef BUFFERED_WRITER_H
+#define BUFFERED_WRITER_H
+
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Output file written through one large page-aligned buffer
+// Lines are copied into the buffer with plain memcpy (no stream sentries, locales or per-line
+// virtual calls), and the buffer goes to the file in a single write syscall whenever it is full.
+// A line that does not fit into an empty buffer is written together with the buffered bytes by one
+// writev, without being copied. On platforms without POSIX file descriptors the buffer is handed
+// to an std::ofstream instead.
+// close() flushes and reports errors; the destructor flushes too but ignores errors.
+class BufferedWriter {
+public:
+    // Constructor: create or truncate the file, throwing std::ios_base::failure if it cannot be opened
+    explicit BufferedWriter(const std::string& filePath, size_t bufferBytes = 1 << 20);
+
+    BufferedWriter(BufferedWriter const&) = delete;
+    BufferedWriter& operator=(BufferedWriter const&) = delete;
+
+    // Destructor: flushes and closes the file if close() was not called
+    ~BufferedWriter();
+
+    // Append bytes to the file
+    void append(std::string_view bytes) {
+        if (bytes.size() <= _capacity - _used) {
+            std::memcpy(_buffer.get() + _used, bytes.data(), bytes.size());
+            _used += bytes.size();
+        } else {
+            appendSlow(bytes, false);
+        }
+    }
+
+    // Append a line, i.e. the bytes followed by '\n'
+    void appendLine(std::string_view line) {
+        if (line.size() < _capacity - _used) {
+            std::memcpy(_buffer.get() + _used, line.data(), line.size());
+            _buffer[_used + line.size()] = '\n';
+            _used += line.size() + 1;
+        } else {
+            appendSlow(line, true);
+        }
+    }
+
+    // Write the buffered bytes to the file, throwing std::ios_base::failure on error
+    void flush();
+
+    // Flush and close the file, throwing std::ios_base::failure on error
+    void close();
+
+    // Number of bytes appended so far
+    size_t bytesWritten() const { return _flushed + _used; }
+
+    // Number of write syscalls (or stream writes) issued so far
+    size_t writeCalls() const { return _writeCalls; }
+
+private:
+    struct AlignedDelete {
+        void operator()(char* p) const;
+    };
+
+    // Append when the buffer does not have room: flush, then buffer or write the bytes directly
+    void appendSlow(std::string_view bytes, bool newline);
+
+    // Write the buffered bytes followed by `extra` (may be empty) and empty the buffer
+    void writeOut(std::string_view extra);
+
+    std::string _filePath; // For error messages
+    std::unique_ptr<char[], AlignedDelete> _buffer; // Page-aligned buffer of _capacity bytes
+    size_t _capacity; // Size of the buffer
+    size_t _used = 0; // Number of bytes in the buffer
+    size_t _flushed = 0; // Number of bytes already handed to the file
+    size_t _writeCalls = 0;
+    int _fd = -1; // File descriptor (POSIX)
+    std::unique_ptr<std::ofstream> _stream; // Output stream where file descriptors are not available
+};
+
+#endif // BUFFERED_WRITER_H
@@ -1,23 +1,11 @@
 #include "header.h"
 #include <fstream>
-#include <sstream>
 #include <filesystem>
-#include <iterator>
 #include <stdexcept>
 #include <iostream>
-
-// Timer class implementation
-// Constructor: Initializes the timer by recording the current time
-Timer::Timer() {
-    start_time = std::chrono::high_resolution_clock::now();
-}
-
-// Stops the timer and calculates the elapsed time since the timer started
-void Timer::stop(const std::string& processName) {
-    auto end_time = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
-    std::cout << processName << " took " << duration << "ms.\n"; // Prints the duration with the process name
-}
+#include <atomic>
+#include <exception>
+#include <optional>
 
 // Read the file into a string
 // Reads the entire content of a file specified by `filePath` into a single string
@@ -57,121 +45,444 @@ std::string trimApostrophes(const std::string& word) {
     return (start == std::string::npos || end == std::string::npos) ? "" : word.substr(start, end - start + 1);
 }
 
+// Tokenize the text into views
+// The text is lowercased into the buffer and split into words by the vectorized kernel
+TokenizedText tokenizeViews(std::string_view text, SimdLevel level) {
+    TokenizedText result{std::make_unique_for_overwrite<char[]>(text.size()), {}};
+    result.words.reserve(text.size() / 4); // English averages about one word per 6 bytes, so this rarely regrows
+    scanWords(text, result.buffer.get(), result.words, level);
+    return result;
+}
+
+TokenizedText tokenizeViews(std::string_view text) {
+    return tokenizeViews(text, detectSimdLevel());
+}
+
 // Tokenize the text into words
 // Converts the input text to lowercase, removes punctuation and numbers, and splits it into words
 std::vector<std::string> tokenize(const std::string& text) {
-    // Preprocess the text: Replace non-alphanumeric characters and numbers with spaces and convert to lowercase
-    auto preprocess = [](const std::string& input) {
-        return std::accumulate(input.begin(), input.end(), std::string(), [](std::string acc, unsigned char c) {
-            // Keep only alphabetic characters and apostrophes
-            acc.push_back((std::isalpha(c) || c == '\'') ? std::tolower(c) : ' ');
-            return acc;
-        });
-    };
+    auto tokens = tokenizeViews(text);
+    return {tokens.words.begin(), tokens.words.end()}; // One string per word
+}
 
-    // Split the processed string into individual words
-    auto splitIntoWords = [](const std::string& processed) {
-        std::istringstream iss(processed); // Use stringstream for splitting
-        return std::vector<std::string>{std::istream_iterator<std::string>(iss), std::istream_iterator<std::string>()};
-    };
+// N-way parallel tokenization into views
+// Chunk boundaries are moved forward to the next separator (a byte that is neither a letter nor an
+// apostrophe), so no word crosses a boundary. Every chunk is lowercased in place into the shared
+// buffer at its own offset, and the workers take chunks from a shared counter, so fast workers
+// take more chunks. The per-chunk word lists are finally concatenated in parallel.
+TokenizedText parallelTokenizeViews(std::string_view text, unsigned workers, size_t chunkBytes) {
+    TokenizedText result{std::make_unique_for_overwrite<char[]>(text.size()), {}};
+    char* out = result.buffer.get();
+    chunkBytes = std::max<size_t>(chunkBytes, 1);
 
-    // Clean the tokens: Trim apostrophes and remove empty tokens
-    auto cleanTokens = [](const std::vector<std::string>& tokens) {
-        return std::accumulate(tokens.begin(), tokens.end(), std::vector<std::string>(), [](std::vector<std::string> acc, const std::string& token) {
-            auto cleaned = trimApostrophes(token); // Trim apostrophes from each word
-            if (!cleaned.empty()) acc.push_back(std::move(cleaned)); // Only add non-empty words
-            return acc;
+    // Step 1: Cut the text into chunks at safe boundaries
+    auto isWordByte = [](unsigned char c) { return isAsciiLetter(c) || c == '\''; };
+    std::vector<size_t> bounds{0};
+    while (bounds.back() < text.size()) {
+        size_t end = std::min(text.size(), bounds.back() + chunkBytes);
+        while (end < text.size() && isWordByte(text[end])) ++end; // Do not cut inside a word
+        bounds.push_back(end);
+    }
+    const size_t chunks = bounds.size() - 1;
+    workers = static_cast<unsigned>(std::clamp<size_t>(workers, 1, std::max<size_t>(chunks, 1)));
+    if (workers == 1) {
+        // A single thread gains nothing from chunking, and skipping it avoids the concatenation
+        result.words.reserve(text.size() / 4);
+        scanWords(text, out, result.words, detectSimdLevel());
+        return result;
+    }
+
+    // Run task(chunk) for every chunk in `workers` pool tasks, each taking the next chunk until none is left
+    auto forEachChunk = [&](auto task) {
+        std::atomic<size_t> next{0};
+        parallelFor(0, workers, [&](size_t) {
+            for (size_t c; (c = next.fetch_add(1, std::memory_order_relaxed)) < chunks;) task(c);
         });
     };
-    return cleanTokens(splitIntoWords(preprocess(text))); // Apply all steps and return the final list of words
+
+    // Step 2: Tokenize the chunks
+    const SimdLevel level = detectSimdLevel();
+    std::vector<std::vector<std::string_view>> chunkWords(chunks);
+    forEachChunk([&](size_t c) {
+        ScopedSpan span("Tokenize Chunk", SpanLevel::Trace);
+        std::string_view chunk = text.substr(bounds[c], bounds[c + 1] - bounds[c]);
+        chunkWords[c].reserve(chunk.size() / 4);
+        scanWords(chunk, out + bounds[c], chunkWords[c], level); // Views already point into the shared buffer
+        span.arg("chunk", static_cast<std::int64_t>(c));
+        span.arg("bytes", static_cast<std::int64_t>(chunk.size()));
+        span.arg("words", static_cast<std::int64_t>(chunkWords[c].size()));
+    });
+
+    // Step 3: Concatenate the word lists, each chunk copied to its offset
+    std::vector<size_t> offsets(chunks + 1, 0);
+    for (size_t c = 0; c < chunks; ++c) offsets[c + 1] = offsets[c] + chunkWords[c].size();
+    result.words.resize(offsets.back());
+    forEachChunk([&](size_t c) {
+        ScopedSpan span("Concatenate Chunk", SpanLevel::Trace);
+        span.arg("chunk", static_cast<std::int64_t>(c));
+        std::copy(chunkWords[c].begin(), chunkWords[c].end(), result.words.begin() + offsets[c]);
+        std::vector<std::string_view>().swap(chunkWords[c]); // Release the chunk's list early
+    });
+    return result;
 }
 
 // Parallel tokenization of the text
-// Splits the text into two parts, processes them in parallel, and merges the results
+// Tokenizes the text in chunks on several threads and converts the views to strings
 std::vector<std::string> parallelTokenize(const std::string& text) {
-    if (text.empty()) return {}; // If the input text is empty, return an empty vector
-    if (text.size() < 2) return tokenize(text); // If the text is very short, fallback to sequential tokenization
+    auto tokens = parallelTokenizeViews(text);
+    return {tokens.words.begin(), tokens.words.end()}; // One string per word
+}
 
-    // Find a suitable split point (avoid splitting inside a word)
-    size_t mid = text.size() / 2;
-    while (mid > 0 && (std::isalnum(text[mid]) || text[mid] == '\'')) --mid;
+// Write sorted words to a file
+// Outputs the vector of words to a file, with one word per line
+void writeToFile(const std::string& filePath, const std::vector<std::string>& words) {
+    writeToFile(filePath, words.begin(), words.end());
+}
 
-    // Launch parallel tasks to tokenize each half of the text
-    auto future1 = std::async(std::launch::async, tokenize, text.substr(0, mid)); // Tokenize the first half
-    auto future2 = std::async(std::launch::async, tokenize, text.substr(mid)); // Tokenize the second half
+// Streaming tree construction
+// Each chunk is read behind the carried-over bytes, cut after its last separator, and the part
+// before the cut is tokenized into reused buffers and inserted right away. Only distinct words
+// outlive their chunk, as copies in the tree's nodes.
+WordTree buildTreeStreaming(const std::string& inputPath, size_t chunkBytes, StreamingStats& stats) {
+    // Check if the file exists, otherwise throw an error (as readFile does)
+    if (!std::filesystem::exists(inputPath)) {
+        throw std::runtime_error("File does not exist: " + inputPath);
+    }
+    std::ifstream file(inputPath, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::ios_base::failure("Failed to open file: " + inputPath);
+    }
 
-    // Wait for both tasks to complete and get the results
-    auto words1 = future1.get();
-    auto words2 = future2.get();
+    stats = StreamingStats();
+    chunkBytes = std::max<size_t>(chunkBytes, 1);
+    ArenaAllocator<std::string> alloc; // Kept to observe the tree's arena
+    WordTree::Transient builder{WordTree(alloc)};
+    std::vector<char> input(chunkBytes); // Carried-over bytes followed by the new chunk
+    std::vector<char> lowered(chunkBytes); // Lowercased text the word views point into
+    std::vector<std::string_view> words;
+    const SimdLevel level = detectSimdLevel();
+    auto isWordByte = [](unsigned char c) { return isAsciiLetter(c) || c == '\''; };
+    const size_t inlineChars = std::string().capacity(); // Longer words get a heap buffer in their node
+    size_t wordBytes = 0; // Heap buffers of the words stored in the tree
 
-    // Merge tokens that might have been split across the split point
-    if (!words1.empty() && !words2.empty() && (std::isalnum(text[mid]) || text[mid] == '\'')) {
-        words1.back() += words2.front(); // Merge the last word of the first half with the first word of the second half
-        words2.erase(words2.begin()); // Remove the merged word from the second list
-    }
+    size_t carry = 0; // Bytes of a word cut by the end of the previous chunk
+    bool atEnd = false;
+    while (!atEnd) {
+        if (input.size() - carry < chunkBytes / 2 + 1) {
+            input.resize(2 * input.size()); // A single word fills the buffer: make room for more of it
+            lowered.resize(input.size());
+        }
+        file.read(input.data() + carry, static_cast<std::streamsize>(input.size() - carry));
+        size_t size = carry + static_cast<size_t>(file.gcount());
+        atEnd = !file; // A short read means the end of the file
+        stats.bytesRead += size - carry;
+        ++stats.chunks;
 
-    // Combine the two lists of words into one
-    return std::accumulate(
-        words2.begin(), words2.end(), std::move(words1),
-        [](std::vector<std::string> acc, const std::string& word) {
-            acc.push_back(word);
-            return acc;
+        // Cut after the last separator, unless this is the end of the text
+        size_t cut = size;
+        if (!atEnd) {
+            while (cut > 0 && isWordByte(input[cut - 1])) --cut;
         }
-    );
-}
 
-// Write sorted words to a file
-// Outputs the vector of words to a file, with one word per line
-void writeToFile(const std::string& filePath, const std::vector<std::string>& words) {
-    if (words.empty()) return; // If there are no words, do nothing
+        ScopedSpan span("Stream Chunk", SpanLevel::Trace);
+        words.clear();
+        scanWords(std::string_view(input.data(), cut), lowered.data(), words, level);
+        for (std::string_view word : words) {
+            if (word.size() <= inlineChars) {
+                builder.insert(word);
+                continue;
+            }
+            const size_t nodes = WordTree::allocationCount(); // A new node means a new heap buffer
+            builder.insert(word);
+            if (WordTree::allocationCount() != nodes) wordBytes += word.size() + 1;
+        }
+        stats.words += words.size();
+        span.arg("bytes", static_cast<std::int64_t>(cut));
+        span.arg("words", static_cast<std::int64_t>(words.size()));
+        span.stop();
+
+        carry = size - cut;
+        std::copy(input.begin() + cut, input.begin() + size, input.begin()); // Carry the cut word over
+        stats.highWaterBytes = std::max(stats.highWaterBytes,
+            input.capacity() + lowered.capacity() + words.capacity() * sizeof(std::string_view) +
+            alloc.arena().bytesReserved() + wordBytes);
+    }
+    return builder.persistent();
+}
 
-    std::ofstream file(filePath, std::ios::out | std::ios::trunc); // Open the file for writing
+// Pipelined tree construction
+// Chunks are cut at separators exactly as in buildTreeStreaming, but each chunk is handed over as
+// its own buffer so that the tokenizers can work on several at once. Tokenized batches may reach
+// the inserter out of order, which does not matter for a set.
+WordTree buildTreePipelined(const std::string& inputPath, size_t chunkBytes, unsigned tokenizers, PipelineStats& stats) {
+    // Check if the file exists, otherwise throw an error (as readFile does)
+    if (!std::filesystem::exists(inputPath)) {
+        throw std::runtime_error("File does not exist: " + inputPath);
+    }
+    std::ifstream file(inputPath, std::ios::binary);
     if (!file.is_open()) {
-        throw std::ios_base::failure("Failed to open file: " + filePath);
+        throw std::ios_base::failure("Failed to open file: " + inputPath);
     }
 
-    // Write each word to a new line
-    for (const auto& word : words) {
-        file << word << '\n';
+    stats = PipelineStats();
+    chunkBytes = std::max<size_t>(chunkBytes, 1);
+    tokenizers = std::max(tokenizers, 1u);
+    BoundedQueue<std::vector<char>> chunks(2 * tokenizers); // Two chunks in flight per tokenizer
+    BoundedQueue<TokenizedText> batches(2 * tokenizers);
+    std::exception_ptr readError;
+    std::vector<std::exception_ptr> tokenizeErrors(tokenizers);
+    std::thread reader;
+    std::vector<std::thread> workers;
+
+    // On every way out (including an exception on this thread), stop the stages and join them:
+    // closing both queues makes blocked producers give up and consumers drain and stop
+    struct JoinGuard {
+        BoundedQueue<std::vector<char>>& chunks;
+        BoundedQueue<TokenizedText>& batches;
+        std::thread& reader;
+        std::vector<std::thread>& workers;
+
+        ~JoinGuard() { join(); }
+
+        void join() {
+            chunks.close();
+            batches.close();
+            if (reader.joinable()) reader.join();
+            for (auto& worker : workers) {
+                if (worker.joinable()) worker.join();
+            }
+        }
+    } joinGuard{chunks, batches, reader, workers};
+
+    // Stage 1: Read the file and cut it into chunks
+    reader = std::thread([&]() {
+        try {
+            Metrics::nameThread("pipeline reader");
+            ScopedSpan span("Pipeline Reader");
+            auto isWordByte = [](unsigned char c) { return isAsciiLetter(c) || c == '\''; };
+            std::vector<char> carried; // Word cut by the end of the previous chunk
+            for (bool atEnd = false; !atEnd;) {
+                size_t carry = carried.size();
+                ScopedSpan readSpan("Read Chunk", SpanLevel::Trace);
+                std::vector<char> chunk(carry + chunkBytes);
+                std::copy(carried.begin(), carried.end(), chunk.begin());
+                file.read(chunk.data() + carry, static_cast<std::streamsize>(chunkBytes));
+                size_t size = carry + static_cast<size_t>(file.gcount());
+                atEnd = !file; // A short read means the end of the file
+                readSpan.arg("bytes", static_cast<std::int64_t>(size));
+                readSpan.stop();
+
+                // Cut after the last separator, unless this is the end of the text
+                size_t cut = size;
+                if (!atEnd) {
+                    while (cut > 0 && isWordByte(chunk[cut - 1])) --cut;
+                }
+                carried.assign(chunk.begin() + cut, chunk.begin() + size);
+                chunk.resize(cut);
+                if (!chunk.empty()) {
+                    if (!chunks.push(std::move(chunk))) break; // Torn down
+                    ++stats.chunks;
+                }
+            }
+        } catch (...) {
+            readError = std::current_exception();
+        }
+        chunks.close();
+    });
+
+    // Stage 2: Tokenize the chunks; the last tokenizer to finish closes the batch queue
+    std::atomic<unsigned> running{tokenizers};
+    for (unsigned w = 0; w < tokenizers; ++w) {
+        workers.emplace_back([&, w]() {
+            try {
+                Metrics::nameThread("pipeline tokenizer " + std::to_string(w));
+                ScopedSpan span("Pipeline Tokenizer");
+                for (std::vector<char> chunk; chunks.pop(chunk);) {
+                    ScopedSpan chunkSpan("Tokenize Chunk", SpanLevel::Trace);
+                    TokenizedText batch = tokenizeViews(std::string_view(chunk.data(), chunk.size()));
+                    chunkSpan.arg("bytes", static_cast<std::int64_t>(chunk.size()));
+                    chunkSpan.arg("words", static_cast<std::int64_t>(batch.words.size()));
+                    chunkSpan.stop();
+                    if (!batches.push(std::move(batch))) break; // Torn down
+                }
+            } catch (...) {
+                tokenizeErrors[w] = std::current_exception();
+                chunks.close(); // Stop reading: the result would be incomplete anyway
+            }
+            if (running.fetch_sub(1, std::memory_order_acq_rel) == 1) batches.close();
+        });
+    }
+
+    // Stage 3: Insert the batches on the calling thread, in place
+    WordTree::Transient builder;
+    ScopedSpan insertSpan("Pipeline Insertion");
+    for (TokenizedText batch; batches.pop(batch);) {
+        ScopedSpan batchSpan("Insert Batch", SpanLevel::Trace);
+        batchSpan.arg("words", static_cast<std::int64_t>(batch.words.size()));
+        for (std::string_view word : batch.words) builder.insert(word);
+        stats.words += batch.words.size();
+    }
+    insertSpan.stop();
+
+    joinGuard.join(); // Before reading the errors
+    if (readError) std::rethrow_exception(readError);
+    for (const auto& error : tokenizeErrors) {
+        if (error) std::rethrow_exception(error);
+    }
+    stats.chunkQueue = chunks.stats();
+    stats.batchQueue = batches.stats();
+    return builder.persistent();
+}
+
+// Steps 1 to 3 of processFileWithTiming with the whole input in memory
+static WordTree buildTreeInMemory(const std::string& inputPath, const ProcessingOptions& options) {
+    const bool useParallel = options.useParallel;
+
+    // Step 1: Read the file
+    // A mapped file is read lazily by the page faults of the first pass over it (tokenization)
+    ScopedSpan readSpan("Reading File");
+    std::string buffered;
+    MappedFile mapped;
+    std::string_view content;
+    if (options.mapInput) {
+        mapped = MappedFile(inputPath, options.populate);
+        content = mapped.view();
+    } else {
+        buffered = readFile(inputPath);
+        content = buffered;
     }
+    readSpan.stop();
+    countMetric("bytes_read", static_cast<std::int64_t>(content.size()));
+
+    // Step 2: Tokenize the text (sequential or parallel)
+    // The words are kept as views into one buffer and only the distinct words are ever
+    // copied, into the tree's nodes
+    ScopedSpan tokenizeSpan("Tokenization");
+    TokenizedText tokens = useParallel ? parallelTokenizeViews(content) : tokenizeViews(content);
+    std::string().swap(buffered); // The input is not needed anymore: release it before building the tree
+    mapped = MappedFile();
+    tokenizeSpan.stop();
+    countMetric("tokens", static_cast<std::int64_t>(tokens.words.size()));
+
+    // Step 3: Insert tokens into a Red-Black Tree
+    ScopedSpan treeSpan("Tree Construction");
+    auto buildSequential = [&]() {
+        WordTree::Transient builder; // Nothing observes intermediate versions, so build in place
+        for (std::string_view word : tokens.words) builder.insert(word);
+        return builder.persistent();
+    };
+    auto tree = useParallel ? rangePartitionedInsertRange<WordTree>(tokens.words.begin(), tokens.words.end())
+                            : buildSequential();
+    treeSpan.stop();
+    return tree;
 }
 
 // Process the file and time each step
 // Reads the input file, tokenizes its content, inserts words into a Red-Black Tree, and writes the sorted output
-void processFileWithTiming(const std::string& inputPath, const std::string& outputPath, bool useParallel) {
+void processFileWithTiming(const std::string& inputPath, const std::string& outputPath, const ProcessingOptions& options) {
     try {
         std::cout << "Processing file: " << inputPath << "\n";
 
-        Timer totalTimer; // Timer to measure the total processing time
-
-        // Step 1: Read the file
-        Timer readTimer;
-        std::string content = readFile(inputPath);
-        readTimer.stop("Reading File");
-
-        // Step 2: Tokenize the text (sequential or parallel)
-        Timer tokenizeTimer;
-        auto tokens = useParallel ? parallelTokenize(content) : tokenize(content);
-        tokenizeTimer.stop("Tokenization");
-
-        // Step 3: Insert tokens into a Red-Black Tree
-        Timer treeTimer;
-        auto tree = useParallel ? parallelInsert(tokens) : std::accumulate(tokens.begin(), tokens.end(), RBTree<std::string>(),
-            [](const RBTree<std::string>& t, const std::string& s) { return t.insert(s); });
-        treeTimer.stop("Tree Construction");
+        Metrics metrics(options.runName, !options.tracePath.empty()); // Spans and counters of this run
+        MetricsScope activeMetrics(metrics);
+        metrics.label("input", inputPath);
+        metrics.label("mode", options.pipelineChunkBytes ? "pipelined"
+                              : options.streamChunkBytes ? "streaming"
+                              : options.useParallel      ? "parallel"
+                                                         : "sequential");
+        AllocationTrackingScope tracking(options.trackAllocations);
+        if (options.trackAllocations && !AllocationTracker::available()) {
+            std::cout << "Allocation tracking unavailable: configure with -DRBTREE_TRACK_ALLOCATIONS=ON.\n";
+        }
+        std::optional<PerfCounters> hardware;
+        if (options.hardwareCounters) {
+            ThreadPool::global(); // Counters follow the threads that exist: start the workers first
+            hardware.emplace();
+            if (!hardware->error().empty()) std::cout << "Hardware counters unavailable: " << hardware->error() << "\n";
+            if (hardware->available()) metrics.setPerfCounters(&*hardware);
+        }
+        const size_t nodesBefore = WordTree::totalAllocationCount();
+        const AllocationStats allocationsBefore = AllocationTracker::totalStats();
+        ScopedSpan totalSpan("Total Processing");
 
-        // Step 4: Retrieve sorted words from the tree
-        Timer sortTimer;
-        auto sorted = tree.getSortedValues();
-        sortTimer.stop("Sorting");
+        // Steps 1 to 3: Read, tokenize and build the tree, either at once or chunk by chunk
+        auto tree = [&]() {
+            if (options.pipelineChunkBytes) {
+                ScopedSpan pipelineSpan("Pipelined Read, Tokenization and Tree Construction");
+                PipelineStats stats;
+                unsigned tokenizers = std::max(std::thread::hardware_concurrency(), 2u) - 1; // One core inserts
+                auto built = buildTreePipelined(inputPath, options.pipelineChunkBytes, tokenizers, stats);
+                pipelineSpan.stop();
+                metrics.add("bytes_read", static_cast<std::int64_t>(std::filesystem::file_size(inputPath)));
+                metrics.add("tokens", static_cast<std::int64_t>(stats.words));
+                metrics.add("chunks", static_cast<std::int64_t>(stats.chunks));
+                auto report = [&](const char* name, const std::string& key, const QueueStats& queue) {
+                    std::cout << name << " queue: max occupancy " << queue.maxOccupancy << "/" << queue.capacity
+                              << ", mean " << queue.meanOccupancy << ", producers stalled "
+                              << queue.pushStallNs / 1000000 << "ms, consumers stalled "
+                              << queue.popStallNs / 1000000 << "ms.\n";
+                    metrics.set(key + "_queue_max_occupancy", static_cast<std::int64_t>(queue.maxOccupancy));
+                    metrics.set(key + "_queue_push_stall_ns", static_cast<std::int64_t>(queue.pushStallNs));
+                    metrics.set(key + "_queue_pop_stall_ns", static_cast<std::int64_t>(queue.popStallNs));
+                };
+                report("Chunk", "chunk", stats.chunkQueue);
+                report("Batch", "batch", stats.batchQueue);
+                return built;
+            }
+            if (!options.streamChunkBytes) return buildTreeInMemory(inputPath, options);
+            ScopedSpan streamSpan("Streaming Read, Tokenization and Tree Construction");
+            StreamingStats stats;
+            auto streamed = buildTreeStreaming(inputPath, options.streamChunkBytes, stats);
+            streamSpan.stop();
+            std::cout << "Streamed " << stats.chunks << " chunks, high-water mark "
+                      << stats.highWaterBytes / 1024 << " KiB.\n";
+            metrics.add("bytes_read", static_cast<std::int64_t>(stats.bytesRead));
+            metrics.add("tokens", static_cast<std::int64_t>(stats.words));
+            metrics.add("chunks", static_cast<std::int64_t>(stats.chunks));
+            metrics.set("high_water_bytes", static_cast<std::int64_t>(stats.highWaterBytes));
+            return streamed;
+        }();
 
-        // Step 5: Write sorted words to the output file
-        Timer writeTimer;
-        writeToFile(outputPath, sorted);
-        writeTimer.stop("Writing File");
+        // Step 4: Write sorted words to the output file, streaming them from the tree in order,
+        // or copying them to their offsets in the file on several threads
+        ScopedSpan writeSpan("Writing File");
+        if (options.useParallel) {
+            parallelWriteToFile(outputPath, tree);
+        } else {
+            writeToFile(outputPath, tree);
+        }
+        writeSpan.stop();
+        totalSpan.stop();
+        if (AllocationTracker::enabled()) {
+            const AllocationStats allocations = AllocationTracker::totalStats() - allocationsBefore;
+            metrics.set("allocations", allocations.allocations);
+            metrics.set("allocated_bytes", allocations.allocatedBytes);
+            metrics.set("live_bytes", allocations.liveBytes());
+        }
 
-        totalTimer.stop("Total Processing"); // Stop the total timer and print the result
+        metrics.set("distinct_words", static_cast<std::int64_t>(std::distance(tree.begin(), tree.end())));
+        metrics.set("nodes_allocated", static_cast<std::int64_t>(WordTree::totalAllocationCount() - nodesBefore));
+        metrics.set("bytes_written", tree.isEmpty() ? 0 : static_cast<std::int64_t>(std::filesystem::file_size(outputPath)));
+        metrics.printSummary(std::cout);
+        if (!options.metricsPath.empty()) {
+            std::ofstream metricsFile(options.metricsPath, std::ios::app);
+            metrics.writeJson(metricsFile);
+            if (!metricsFile) {
+                throw std::ios_base::failure("Failed to write metrics to: " + options.metricsPath);
+            }
+        }
+        if (!options.tracePath.empty()) {
+            std::ofstream traceFile(options.tracePath, std::ios::trunc);
+            metrics.writeChromeTrace(traceFile);
+            if (!traceFile) {
+                throw std::ios_base::failure("Failed to write trace to: " + options.tracePath);
+            }
+        }
     } catch (const std::exception& e) {
         std::cerr << "Error processing file: " << e.what() << "\n"; // Handle errors gracefully
     }
+}
+
+void processFileWithTiming(const std::string& inputPath, const std::string& outputPath, bool useParallel) {
+    processFileWithTiming(inputPath, outputPath, ProcessingOptions{.useParallel = useParallel});
 }
\ No newline at end of file
@@ -1,11 +1,23 @@
 #ifndef HEADER_H
 #define HEADER_H
 
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
-#include <future>
+#include <algorithm>
+#include <fstream>
 #include <numeric>
+#include <cstring>
+#include <thread>
 #include "redBlackTree.h"
+#include "nodeArena.h"
+#include "tokenizerKernels.h"
+#include "mappedFile.h"
+#include "bufferedWriter.h"
+#include "boundedQueue.h"
+#include "threadPool.h"
+#include "metrics.h"
 
 // Function declarations
 // Reads the content of a file and returns it as a single string
@@ -14,82 +26,302 @@ std::string readFile(const std::string& filePath);
 // Trims leading and trailing apostrophes from a word
 std::string trimApostrophes(const std::string& word);
 
+// Words of a text as views into a single lowercase copy of the text
+// The views point into `buffer`, so they stay valid as long as the object lives (also once moved)
+struct TokenizedText {
+    std::unique_ptr<char[]> buffer; // Copy of the text with letters lowercased
+    std::vector<std::string_view> words; // Words in order of appearance
+};
+
+// Tokenizes the input text in a single pass without allocating per word
+// A word is a run of letters and apostrophes, lowercased, with leading and trailing apostrophes removed
+// Uses the best SIMD kernel of the CPU; the overload forces a level (for tests and benchmarks)
+TokenizedText tokenizeViews(std::string_view text);
+TokenizedText tokenizeViews(std::string_view text, SimdLevel level);
+
 // Tokenizes the input text into a vector of words, removing punctuation and converting to lowercase
 std::vector<std::string> tokenize(const std::string& text);
 
-// Performs parallel tokenization by splitting the input text into two parts
-// and processing them in separate threads, then merging the results
+// Performs parallel tokenization by splitting the input text into chunks of about chunkBytes
+// (cut between words, never inside one) that `workers` threads tokenize in place
+// The result is exactly the same as tokenizeViews(text)
+TokenizedText parallelTokenizeViews(std::string_view text,
+                                    unsigned workers = std::thread::hardware_concurrency(),
+                                    size_t chunkBytes = 256 * 1024);
+
+// Parallel counterpart of tokenize, returning the same words
 std::vector<std::string> parallelTokenize(const std::string& text);
 
+// Writes the words in [first, last) to the specified file, each word on a new line
+// The words (anything convertible to std::string_view, e.g. through a tree iterator) are copied
+// into a large buffer that is written with few syscalls (see BufferedWriter). Nothing is written,
+// and the file is not created, if the range is empty.
+template <typename It>
+void writeToFile(const std::string& filePath, It first, It last, size_t bufferBytes = 1 << 20) {
+    if (first == last) return; // If there are no words, do nothing
+
+    BufferedWriter file(filePath, bufferBytes);
+    for (; first != last; ++first) {
+        file.appendLine(*first);
+    }
+    file.close(); // Report write errors, which the destructor would ignore
+}
+
 // Writes a vector of words to the specified file, with each word on a new line
 void writeToFile(const std::string& filePath, const std::vector<std::string>& words);
 
+// Writes the words of a tree to the specified file in sorted order, streaming them directly
+// from the tree instead of materializing a sorted vector first
+template <typename Alloc, typename RefCount>
+void writeToFile(const std::string& filePath, const RBTree<std::string, Alloc, RefCount>& words) {
+    writeToFile(filePath, words.begin(), words.end());
+}
+
+// Writes the words in [first, last) to the specified file like writeToFile, on several threads
+// The words are cut into pieces; the byte size of every piece (word lengths plus newlines) is summed
+// in parallel, and a prefix sum over the pieces gives the offset of each piece in the output. The
+// file is then created at its final size and mapped, and the pieces are copied to their offsets
+// concurrently. The contents are exactly those writeToFile produces.
+template <typename It>
+void parallelWriteToFile(const std::string& filePath, It first, It last,
+                         unsigned workers = std::thread::hardware_concurrency()) {
+    const size_t count = static_cast<size_t>(last - first);
+    if (count == 0) return; // If there are no words, do nothing (as writeToFile)
+    if (workers <= 1) {
+        writeToFile(filePath, first, last); // A single thread is better off streaming
+        return;
+    }
+
+    // Step 1: Size of every piece (a few pieces per worker, so that uneven words balance out)
+    const size_t pieces = std::min<size_t>(count, workers * size_t{4});
+    auto pieceBegin = [&](size_t p) { return first + static_cast<std::ptrdiff_t>(p * count / pieces); };
+    std::vector<size_t> offsets(pieces + 1, 0);
+    parallelFor(0, pieces, [&](size_t p) {
+        size_t bytes = 0;
+        for (It word = pieceBegin(p); word != pieceBegin(p + 1); ++word) {
+            bytes += std::string_view(*word).size() + 1;
+        }
+        offsets[p + 1] = bytes;
+    });
+
+    // Step 2: Exclusive prefix sum, giving the offset of every piece and the size of the file
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+    // Step 3: Copy the pieces to their offsets in the mapped file
+    MappedOutputFile file(filePath, offsets.back());
+    parallelFor(0, pieces, [&](size_t p) {
+        ScopedSpan span("Write Piece", SpanLevel::Trace);
+        span.arg("bytes", static_cast<std::int64_t>(offsets[p + 1] - offsets[p]));
+        char* out = file.data() + offsets[p];
+        for (It word = pieceBegin(p); word != pieceBegin(p + 1); ++word) {
+            std::string_view view(*word);
+            std::memcpy(out, view.data(), view.size());
+            out[view.size()] = '\n';
+            out += view.size() + 1;
+        }
+    });
+    file.close(); // Report errors, which the destructor would ignore
+}
+
+// Writes a vector of words to the specified file on several threads (see parallelWriteToFile)
+template <typename T>
+void parallelWriteToFile(const std::string& filePath, const std::vector<T>& words,
+                         unsigned workers = std::thread::hardware_concurrency()) {
+    parallelWriteToFile(filePath, words.begin(), words.end(), workers);
+}
+
+// Writes the words of a tree to the specified file in sorted order, on several threads
+// The tree's iterators only move forward, so the words are first collected as views into the nodes.
+template <typename Alloc, typename RefCount>
+void parallelWriteToFile(const std::string& filePath, const RBTree<std::string, Alloc, RefCount>& words,
+                         unsigned workers = std::thread::hardware_concurrency()) {
+    std::vector<std::string_view> sorted(words.begin(), words.end());
+    parallelWriteToFile(filePath, sorted.begin(), sorted.end(), workers);
+}
+
+// Options for processFileWithTiming
+struct ProcessingOptions {
+    bool useParallel = false; // Tokenize, build the tree and write the output on several threads
+    bool mapInput = false; // Memory-map the input instead of reading it into a string
+    bool populate = false; // With mapInput: fault in the whole file while mapping
+    size_t streamChunkBytes = 0; // If not 0: stream the input in chunks of this size (see buildTreeStreaming)
+    size_t pipelineChunkBytes = 0; // If not 0: overlap the stages on chunks of this size (see buildTreePipelined)
+    std::string runName{}; // Name of the run in the metrics
+    std::string metricsPath{}; // If not empty: append the run's metrics to this file, as one line of JSON
+    std::string tracePath{}; // If not empty: also record trace spans, and write a Chrome trace of the run here
+    bool trackAllocations = false; // Count the heap allocations of every stage (see AllocationTracker)
+    bool hardwareCounters = false; // Read hardware performance counters around every stage (see PerfCounters)
+};
+
 // Processes a file by reading its content, tokenizing the text, inserting words into a tree,
 // and writing the sorted output to a file. Supports parallel processing for optimization.
+// Every stage is timed as a span of a Metrics registry, which also counts bytes, words and nodes;
+// the stage durations are printed, and the whole registry is written to options.metricsPath.
+// With options.tracePath, the run is also traced per chunk, task and merge (see writeChromeTrace).
+// With options.trackAllocations, the spans also count the allocations, bytes and live bytes of their stage.
+// With options.hardwareCounters, the stages also report cycles, instructions and misses, where the kernel allows.
+void processFileWithTiming(const std::string& inputPath, const std::string& outputPath, const ProcessingOptions& options);
 void processFileWithTiming(const std::string& inputPath, const std::string& outputPath, bool useParallel = false);
 
-// Utility class to measure execution time for processes
-class Timer {
-public:
-    // Constructor: Starts the timer when an object of Timer is created
-    Timer();
+// Tree type used for word processing: nodes live in a slab arena owned by the tree lineage
+// and use non-atomic reference counts, since every lineage is confined to one thread at a time
+using WordTree = RBTree<std::string, ArenaAllocator<std::string>, LocalRefCount>;
 
-    // Stops the timer and prints the duration with a custom process name
-    void stop(const std::string& processName);
+// Statistics of a streaming run
+struct StreamingStats {
+    size_t chunks = 0; // Number of chunks read
+    size_t bytesRead = 0; // Size of the input
+    size_t words = 0; // Number of words inserted (with duplicates)
+    size_t highWaterBytes = 0; // Peak memory held by the chunk buffers, the tree's arena and the heap buffers of its words
+};
+
+// Reads the file in chunks of chunkBytes and inserts its words into a tree as they are tokenized
+// A word cut by the end of a chunk is carried over to the next one (a buffer grows only if a
+// single word is longer than it). Memory is bounded by the chunk size plus the vocabulary, so
+// inputs larger than RAM can be processed; stats reports the high-water mark.
+WordTree buildTreeStreaming(const std::string& inputPath, size_t chunkBytes, StreamingStats& stats);
 
-private:
-    std::chrono::high_resolution_clock::time_point start_time; // Start time of the timer
+// Metrics of a pipelined run: one queue between each pair of stages
+struct PipelineStats {
+    size_t chunks = 0; // Number of chunks read
+    size_t words = 0; // Number of words inserted (with duplicates)
+    QueueStats chunkQueue; // Reader -> tokenizers (push stalls: tokenizers too slow, pop stalls: reader too slow)
+    QueueStats batchQueue; // Tokenizers -> inserter (push stalls: inserter too slow, pop stalls: tokenizers too slow)
 };
 
+// Overlapped tree construction: a reader thread cuts the file into chunks (carrying words over as
+// buildTreeStreaming does), `tokenizers` threads tokenize the chunks into batches of words, and the
+// calling thread inserts the batches into the tree. The stages communicate through bounded
+// lock-free queues, so a slow stage holds back the ones before it and memory stays bounded.
+WordTree buildTreePipelined(const std::string& inputPath, size_t chunkBytes, unsigned tokenizers, PipelineStats& stats);
+
+// Merges two Red-Black Trees with a join-based union
+// Runs in O(m log(n/m + 1)) instead of re-inserting every value of the second tree, and
+// subtrees shared by both trees are kept by pointer
+template <typename T, typename Alloc, typename RefCount>
+RBTree<T, Alloc, RefCount> mergeTrees(const RBTree<T, Alloc, RefCount>& tree1, const RBTree<T, Alloc, RefCount>& tree2) {
+    return tree1.unionWith(tree2);
+}
+
+// Recursive helper for parallelInsert: builds a tree from [first, last) with `workers` threads
+// The range and the workers are split in two, the left half is forked on the thread pool, and the two
+// partial trees are merged. The merges therefore form a balanced reduction tree of depth log2(workers).
+// Each leaf starts its own tree lineage, so with an arena allocator every worker owns its arena.
+// Partial trees are handed from thread to thread as a whole when the fork joins, which also
+// makes LocalRefCount safe here: no node is ever referenced from two threads at the same time.
+template <typename Tree, typename It>
+Tree parallelInsertRange(It first, It last, unsigned workers) {
+    if (workers <= 1) {
+        // Sequential base case: insert each word into a fresh tree, in place through a transient
+        ScopedSpan span("Insert Range", SpanLevel::Trace);
+        span.arg("words", static_cast<std::int64_t>(last - first));
+        typename Tree::Transient builder;
+        std::for_each(first, last, [&](const auto& word) { builder.insert(word); });
+        return builder.persistent();
+    }
+
+    // Give each half a share of the words proportional to its share of the workers
+    unsigned leftWorkers = workers / 2;
+    It mid = first + (last - first) * leftWorkers / workers;
+
+    Tree left, right;
+    parallelInvoke([&]() { right = parallelInsertRange<Tree>(mid, last, workers - leftWorkers); },
+                   [&]() { left = parallelInsertRange<Tree>(first, mid, leftWorkers); });
+
+    // Merge the two resulting trees into one
+    ScopedSpan span("Merge Trees", SpanLevel::Trace);
+    span.arg("workers", workers);
+    return mergeTrees(left, right);
+}
+
 // Parallel insertion of elements into a persistent Red-Black Tree
-// Splits the input vector into two halves, inserts them in parallel, and merges the resulting trees
-template <typename T>
-RBTree<T> parallelInsert(const std::vector<T>& words) {
+// Splits the input vector into one chunk per worker, inserts the chunks in parallel,
+// and merges the resulting trees pairwise in a balanced reduction
+template <typename T, typename Alloc = std::allocator<T>, typename RefCount = AtomicRefCount>
+RBTree<T, Alloc, RefCount> parallelInsert(const std::vector<T>& words,
+                                          unsigned workers = std::thread::hardware_concurrency()) {
+    using Tree = RBTree<T, Alloc, RefCount>;
     if (words.empty()) {
         // If the input vector is empty, return an empty Red-Black Tree
-        return RBTree<T>();
+        return Tree();
     }
 
-    // Split the input vector into two halves
-    size_t mid = words.size() / 2;
-
-    // Asynchronously insert the first half into a tree
-    auto futureTree1 = std::async(std::launch::async, [&]() {
-        return std::accumulate(
-            words.begin(), words.begin() + mid, RBTree<T>(),
-            [](const RBTree<T>& tree, const T& word) {
-                return tree.insert(word); // Insert each word into the tree
-            }
-        );
+    // At least one worker, and never more workers than words
+    workers = static_cast<unsigned>(std::clamp<size_t>(workers, 1, words.size()));
+    return parallelInsertRange<Tree>(words.begin(), words.end(), workers);
+}
+
+// Range-partitioned parallel insertion of the words in [first, last) into a tree
+// Splitters are chosen from an evenly spaced sample of the words so that every worker owns one
+// key range. The words are routed to their range in parallel, each worker builds a tree of its
+// range only, and since the trees never overlap they are concatenated in O(log n) each instead
+// of being merged. The words only need to be comparable with and convertible to the tree's value
+// type (e.g. string_views for a WordTree): each distinct word is converted once, into its node.
+template <typename Tree, typename It>
+Tree rangePartitionedInsertRange(It first, It last, unsigned workers = std::thread::hardware_concurrency()) {
+    using Word = std::iter_value_t<It>;
+    const size_t count = static_cast<size_t>(last - first);
+    if (count < 2 || workers <= 1) {
+        return parallelInsertRange<Tree>(first, last, 1); // Nothing to partition
+    }
+    workers = static_cast<unsigned>(std::min<size_t>(workers, count));
+
+    // Step 1: Sample the words (oversampled so that the ranges are even) and pick splitters
+    const size_t sampleSize = std::min<size_t>(count, workers * size_t{64});
+    std::vector<Word> sample(sampleSize);
+    for (size_t i = 0; i < sampleSize; ++i) {
+        sample[i] = first[i * count / sampleSize];
+    }
+    std::sort(sample.begin(), sample.end());
+    sample.erase(std::unique(sample.begin(), sample.end()), sample.end());
+
+    // Bucket b holds the words in [splitters[b - 1], splitters[b])
+    std::vector<Word> splitters;
+    for (unsigned b = 1; b < workers; ++b) {
+        const Word& splitter = sample[b * sample.size() / workers];
+        if (splitters.empty() || splitters.back() < splitter) splitters.push_back(splitter);
+    }
+    const size_t buckets = splitters.size() + 1;
+
+    // Step 2: Route the words to their buckets, one chunk of positions per worker
+    using Routes = std::vector<std::vector<const Word*>>; // One list of words per bucket
+    std::vector<Routes> routes(workers, Routes(buckets));
+    parallelFor(0, workers, [&](size_t w) {
+        ScopedSpan span("Route Words", SpanLevel::Trace);
+        span.arg("words", static_cast<std::int64_t>((w + 1) * count / workers - w * count / workers));
+        for (size_t i = w * count / workers; i < (w + 1) * count / workers; ++i) {
+            const Word& word = first[i];
+            auto bucket = std::upper_bound(splitters.begin(), splitters.end(), word) - splitters.begin();
+            routes[w][bucket].push_back(&word);
+        }
     });
 
-    // Asynchronously insert the second half into a tree
-    auto futureTree2 = std::async(std::launch::async, [&]() {
-        return std::accumulate(
-            words.begin() + mid, words.end(), RBTree<T>(),
-            [](const RBTree<T>& tree, const T& word) {
-                return tree.insert(word); // Insert each word into the tree
-            }
-        );
+    // Step 3: Build one tree per bucket, each in its own lineage and task (in place, no path copying)
+    std::vector<Tree> trees(buckets);
+    parallelFor(0, buckets, [&](size_t b) {
+        ScopedSpan span("Build Bucket", SpanLevel::Trace);
+        typename Tree::Transient builder;
+        size_t words = 0;
+        for (const auto& chunk : routes) {
+            for (const Word* word : chunk[b]) builder.insert(*word);
+            words += chunk[b].size();
+        }
+        trees[b] = builder.persistent();
+        span.arg("bucket", static_cast<std::int64_t>(b));
+        span.arg("words", static_cast<std::int64_t>(words));
     });
 
-    // Merge the two resulting trees into one
-    return mergeTrees(futureTree1.get(), futureTree2.get());
+    // Step 4: The bucket trees cover consecutive key ranges, so concatenation joins them
+    ScopedSpan span("Concatenate Buckets", SpanLevel::Trace);
+    return std::accumulate(trees.begin() + 1, trees.end(), trees.front(),
+        [](const Tree& acc, const Tree& tree) { return Tree::concat(acc, tree); });
 }
 
-// Merges two Red-Black Trees by inserting all values from the second tree into the first tree
-template <typename T>
-RBTree<T> mergeTrees(const RBTree<T>& tree1, const RBTree<T>& tree2) {
-    // Retrieve the sorted values from the second tree
-    auto sortedValues = tree2.getSortedValues();
-
-    // Insert each value into the first tree to merge the two trees
-    return std::accumulate(
-        sortedValues.begin(), sortedValues.end(), tree1,
-        [](const RBTree<T>& accumulatedTree, const T& value) {
-            return accumulatedTree.insert(value); // Insert the value into the accumulated tree
-        }
-    );
+// Range-partitioned parallel insertion of a vector of words (see rangePartitionedInsertRange)
+template <typename T, typename Alloc = std::allocator<T>, typename RefCount = AtomicRefCount>
+RBTree<T, Alloc, RefCount> rangePartitionedInsert(const std::vector<T>& words,
+                                                  unsigned workers = std::thread::hardware_concurrency()) {
+    return rangePartitionedInsertRange<RBTree<T, Alloc, RefCount>>(words.begin(), words.end(), workers);
 }
 
 #endif // HEADER_H
\ No newline at end of file
@@ -3,10 +3,21 @@
 #include "header.h"
 #include <iostream>
 #include <fstream>
+#include <filesystem>
+#include <string_view>
 
+// Usage: final [--perf] (--perf reads hardware performance counters around every stage)
 int main(int argc, char** argv) {
     doctest::Context context;
 
+    // Instrumentation is opt-in: allocations are counted when the build has the hooks
+    // (RBTREE_TRACK_ALLOCATIONS), hardware counters are read with --perf
+    const bool trackAllocations = AllocationTracker::available();
+    bool hardwareCounters = false;
+    for (int i = 1; i < argc; ++i) {
+        if (std::string_view(argv[i]) == "--perf") hardwareCounters = true;
+    }
+
     std::cout << "\nRunning tests...\n";
     int testResult = context.run();
     if (testResult != 0) {
@@ -21,12 +32,37 @@ int main(int argc, char** argv) {
         std::getline(std::cin, inputPath);
 
         const std::string outputPath = "output.txt";
+        const std::string metricsPath = "metrics.jsonl"; // One JSON object per run
+        std::filesystem::remove(metricsPath);
 
         std::cout << "\n=== Sequential Processing ===\n";
-        processFileWithTiming(inputPath, outputPath, false);
+        processFileWithTiming(inputPath, outputPath,
+                              ProcessingOptions{.runName = "sequential", .metricsPath = metricsPath,
+                                                .trackAllocations = trackAllocations, .hardwareCounters = hardwareCounters});
+
+        std::cout << "\n=== Parallel Processing (traced to trace.json) ===\n";
+        processFileWithTiming(inputPath, outputPath,
+                              ProcessingOptions{.useParallel = true, .runName = "parallel", .metricsPath = metricsPath,
+                                                .tracePath = "trace.json", .trackAllocations = trackAllocations,
+                                                .hardwareCounters = hardwareCounters});
+
+        std::cout << "\n=== Parallel Processing (memory-mapped input) ===\n";
+        processFileWithTiming(inputPath, outputPath,
+                              ProcessingOptions{.useParallel = true, .mapInput = true, .runName = "parallel-mapped",
+                                                .metricsPath = metricsPath, .trackAllocations = trackAllocations,
+                                                .hardwareCounters = hardwareCounters});
+
+        std::cout << "\n=== Streaming Processing (1 MiB chunks) ===\n";
+        processFileWithTiming(inputPath, outputPath,
+                              ProcessingOptions{.streamChunkBytes = 1 << 20, .runName = "streaming",
+                                                .metricsPath = metricsPath, .trackAllocations = trackAllocations,
+                                                .hardwareCounters = hardwareCounters});
 
-        std::cout << "\n=== Parallel Processing ===\n";
-        processFileWithTiming(inputPath, outputPath, true);
+        std::cout << "\n=== Pipelined Processing (1 MiB chunks) ===\n";
+        processFileWithTiming(inputPath, outputPath,
+                              ProcessingOptions{.pipelineChunkBytes = 1 << 20, .runName = "pipelined",
+                                                .metricsPath = metricsPath, .trackAllocations = trackAllocations,
+                                                .hardwareCounters = hardwareCounters});
 
     } catch (const std::exception& e) {
         std::cerr << "Error in main: " << e.what() << "\n";
@@ -0,0 +1,151 @@
+#include "mappedFile.h"
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <ios>
+#include <stdexcept>
+#include <utility>
+
+#if __has_include(<sys/mman.h>)
+#define MAPPED_FILE_POSIX 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define MAPPED_FILE_POSIX 0
+#endif
+
+MappedFile::MappedFile(const std::string& filePath, bool populate) {
+    // Check if the file exists, otherwise throw an error (as readFile does)
+    if (!std::filesystem::exists(filePath)) {
+        throw std::runtime_error("File does not exist: " + filePath);
+    }
+#if MAPPED_FILE_POSIX
+    int fd = ::open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open file: " + filePath + ": " + std::strerror(errno));
+    }
+    struct stat info{};
+    if (::fstat(fd, &info) != 0) {
+        int error = errno;
+        ::close(fd);
+        throw std::runtime_error("Failed to stat file: " + filePath + ": " + std::strerror(error));
+    }
+    _size = static_cast<size_t>(info.st_size);
+    if (_size == 0) { // Empty files cannot be mapped, and need not be
+        ::close(fd);
+        return;
+    }
+
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    if (populate) flags |= MAP_POPULATE; // Prefault every page (Linux only)
+#else
+    (void)populate;
+#endif
+    void* address = ::mmap(nullptr, _size, PROT_READ, flags, fd, 0);
+    int error = errno;
+    ::close(fd); // The mapping keeps its own reference to the file
+    if (address == MAP_FAILED) {
+        _size = 0;
+        throw std::runtime_error("Failed to map file: " + filePath + ": " + std::strerror(error));
+    }
+    _data = static_cast<const char*>(address);
+    _mapped = true;
+
+    // Read-ahead hints: the whole file is about to be scanned once from front to back
+    ::madvise(address, _size, MADV_SEQUENTIAL);
+    ::madvise(address, _size, MADV_WILLNEED);
+#else
+    (void)populate;
+    std::ifstream file(filePath, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to open file: " + filePath);
+    }
+    _size = static_cast<size_t>(file.tellg());
+    file.seekg(0, std::ios::beg);
+    _copy = std::make_unique_for_overwrite<char[]>(_size);
+    file.read(_copy.get(), static_cast<std::streamsize>(_size));
+    _data = _copy.get();
+#endif
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+    : _data(std::exchange(other._data, nullptr)), _size(std::exchange(other._size, 0)),
+      _mapped(std::exchange(other._mapped, false)), _copy(std::move(other._copy)) {
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+    MappedFile old(std::move(*this)); // Released at the end of the scope
+    _data = std::exchange(other._data, nullptr);
+    _size = std::exchange(other._size, 0);
+    _mapped = std::exchange(other._mapped, false);
+    _copy = std::move(other._copy);
+    return *this;
+}
+
+MappedFile::~MappedFile() {
+#if MAPPED_FILE_POSIX
+    if (_mapped) ::munmap(const_cast<char*>(_data), _size);
+#endif
+}
+
+MappedOutputFile::MappedOutputFile(const std::string& filePath, size_t size) : _filePath(filePath), _size(size) {
+#if MAPPED_FILE_POSIX
+    _fd = ::open(filePath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (_fd < 0) {
+        throw std::ios_base::failure("Failed to open file: " + filePath);
+    }
+    if (::ftruncate(_fd, static_cast<off_t>(size)) != 0) {
+        ::close(std::exchange(_fd, -1));
+        throw std::ios_base::failure("Failed to resize file: " + filePath);
+    }
+    if (size == 0) return; // Empty files cannot be mapped, and need not be
+
+    void* address = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (address == MAP_FAILED) {
+        ::close(std::exchange(_fd, -1));
+        throw std::ios_base::failure("Failed to map file: " + filePath);
+    }
+    _data = static_cast<char*>(address);
+#else
+    std::ofstream file(filePath, std::ios::out | std::ios::trunc | std::ios::binary); // Create it right away
+    if (!file.is_open()) {
+        throw std::ios_base::failure("Failed to open file: " + filePath);
+    }
+    _copy = std::make_unique_for_overwrite<char[]>(size);
+    _data = _copy.get();
+#endif
+}
+
+MappedOutputFile::~MappedOutputFile() {
+    try {
+        close();
+    } catch (...) {
+        // Errors can only be reported by an explicit close()
+    }
+}
+
+void MappedOutputFile::close() {
+#if MAPPED_FILE_POSIX
+    if (_fd < 0) return;
+    // Unmapping only hands the dirty pages over to the page cache, the kernel writes them back
+    bool failed = _data && ::munmap(_data, _size) != 0;
+    _data = nullptr;
+    failed = ::close(std::exchange(_fd, -1)) != 0 || failed;
+    if (failed) {
+        throw std::ios_base::failure("Failed to write file: " + _filePath);
+    }
+#else
+    if (!_copy) return;
+    auto contents = std::move(_copy);
+    _data = nullptr;
+    std::ofstream file(_filePath, std::ios::out | std::ios::trunc | std::ios::binary);
+    file.write(contents.get(), static_cast<std::streamsize>(_size));
+    if (!file) {
+        throw std::ios_base::failure("Failed to write file: " + _filePath);
+    }
+#endif
+}
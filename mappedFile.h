@@ -0,0 +1,80 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Read-only view of a whole file, memory-mapped where the platform supports it
+// The pages come straight from the page cache (no copy into a userspace buffer), and the kernel is
+// told that the file will be read sequentially so it reads ahead aggressively. With `populate` the
+// whole file is faulted in while mapping, which moves the I/O out of the first pass over the data.
+// On platforms without mmap the file is read into a private buffer instead.
+// The view is valid until the MappedFile is destroyed or assigned to (moving it keeps the view valid).
+class MappedFile {
+public:
+    // Constructor: an empty view
+    MappedFile() = default;
+
+    // Constructor: map the file, throwing std::runtime_error if it does not exist or cannot be mapped
+    explicit MappedFile(const std::string& filePath, bool populate = false);
+
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+
+    // Destructor: unmaps the file
+    ~MappedFile();
+
+    // Contents of the file
+    std::string_view view() const { return {_data, _size}; }
+
+    // Size of the file in bytes
+    size_t size() const { return _size; }
+
+    // Whether the contents are memory-mapped (false for empty files and the buffered fallback)
+    bool isMapped() const { return _mapped; }
+
+private:
+    const char* _data = nullptr; // First byte of the contents
+    size_t _size = 0; // Number of bytes
+    bool _mapped = false; // Whether _data must be unmapped
+    std::unique_ptr<char[]> _copy; // Contents read into memory when mapping is not available
+};
+
+// Writable memory mapping of a new file of a known size
+// The file is created (or truncated) and resized to its final size up front, so that several
+// threads can fill disjoint parts of data() concurrently, straight into the page cache.
+// On platforms without mmap the contents are assembled in a private buffer and written on close.
+class MappedOutputFile {
+public:
+    // Constructor: create the file with `size` bytes and map it, throwing std::ios_base::failure
+    // if the file cannot be created, resized or mapped
+    MappedOutputFile(const std::string& filePath, size_t size);
+
+    MappedOutputFile(MappedOutputFile const&) = delete;
+    MappedOutputFile& operator=(MappedOutputFile const&) = delete;
+
+    // Destructor: unmaps and closes the file if close() was not called
+    ~MappedOutputFile();
+
+    // Contents of the file, to be written
+    char* data() { return _data; }
+
+    // Size of the file in bytes
+    size_t size() const { return _size; }
+
+    // Unmap and close the file, throwing std::ios_base::failure on error
+    void close();
+
+private:
+    std::string _filePath; // For error messages
+    char* _data = nullptr; // First byte of the contents
+    size_t _size = 0; // Number of bytes
+    int _fd = -1; // File descriptor, open until close() (POSIX)
+    std::unique_ptr<char[]> _copy; // Contents assembled in memory when mapping is not available
+};
+
+#endif // MAPPED_FILE_H
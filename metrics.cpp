@@ -0,0 +1,342 @@
+#include "metrics.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <utility>
+
+namespace {
+
+std::atomic<unsigned> nextThreadId{0};
+
+// Name of the calling thread (see Metrics::nameThread)
+thread_local std::string threadName;
+
+// The counted events of a reading as JSON members, with the IPC if known, and whether it is partial
+void writeHardware(std::ostream& out, const PerfReading& reading) {
+    const char* separator = "";
+    for (size_t i = 0; i < perfEventCount; ++i) {
+        auto event = static_cast<PerfEvent>(i);
+        if (!reading.has(event)) continue;
+        out << separator << "\"" << perfEventName(event) << "\":" << std::llround(reading[event]);
+        separator = ",";
+    }
+    if (auto ipc = reading.ipc()) out << separator << "\"ipc\":" << jsonNumber(*ipc);
+    if (reading.partial) out << ",\"partial\":true";
+}
+
+// The details of a span as a JSON member, if it has any (with its allocations and hardware counters,
+// for traces)
+void writeArgs(std::ostream& out, const SpanRecord& span, bool withMeasurements) {
+    const AllocationStats* allocations = withMeasurements && span.allocations ? &*span.allocations : nullptr;
+    const PerfReading* hardware = withMeasurements && span.hardware && !span.hardware->empty() ? &*span.hardware : nullptr;
+    if (span.args.empty() && !allocations && !hardware) return;
+    out << ",\"args\":{";
+    const char* separator = "";
+    for (const auto& [name, value] : span.args) {
+        out << separator << jsonString(name) << ":" << value;
+        separator = ",";
+    }
+    if (allocations) {
+        out << separator << "\"allocations\":" << allocations->allocations << ",\"allocated_bytes\":"
+            << allocations->allocatedBytes << ",\"live_bytes\":" << allocations->liveBytes();
+        separator = ",";
+    }
+    if (hardware) {
+        out << separator;
+        writeHardware(out, *hardware);
+    }
+    out << "}";
+}
+
+// Count for people: 1234, 12.3K, 4.5M or 6.7G
+std::string formatCount(double count) {
+    char text[32];
+    if (count < 1e4) {
+        std::snprintf(text, sizeof text, "%.0f", count);
+    } else if (count < 1e6) {
+        std::snprintf(text, sizeof text, "%.1fK", count / 1e3);
+    } else if (count < 1e9) {
+        std::snprintf(text, sizeof text, "%.1fM", count / 1e6);
+    } else {
+        std::snprintf(text, sizeof text, "%.1fG", count / 1e9);
+    }
+    return text;
+}
+
+// Byte count for people: B, KiB or MiB
+std::string formatBytes(std::int64_t bytes) {
+    char text[32];
+    double magnitude = std::abs(static_cast<double>(bytes));
+    if (magnitude < 1024) {
+        std::snprintf(text, sizeof text, "%lld B", static_cast<long long>(bytes));
+    } else if (magnitude < 1024 * 1024) {
+        std::snprintf(text, sizeof text, "%.1f KiB", static_cast<double>(bytes) / 1024);
+    } else {
+        std::snprintf(text, sizeof text, "%.1f MiB", static_cast<double>(bytes) / (1024 * 1024));
+    }
+    return text;
+}
+
+} // namespace
+
+Metrics::Metrics(std::string runName, bool tracing)
+    : _runName(std::move(runName)), _traced(tracing), _start(std::chrono::steady_clock::now()),
+      _ownerThread(threadId()) {
+}
+
+void Metrics::nameThread(std::string name) {
+    threadName = std::move(name);
+}
+
+unsigned Metrics::threadId() {
+    thread_local const unsigned id = nextThreadId.fetch_add(1, std::memory_order_relaxed);
+    return id;
+}
+
+std::uint64_t Metrics::elapsedNs() const {
+    return static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start).count());
+}
+
+void Metrics::add(std::string_view counter, std::int64_t delta) {
+    UntrackedAllocations untracked;
+    std::lock_guard<std::mutex> guard(_lock);
+    auto it = _counters.find(counter);
+    if (it == _counters.end()) it = _counters.emplace(std::string(counter), 0).first;
+    it->second += delta;
+}
+
+void Metrics::set(std::string_view counter, std::int64_t value) {
+    UntrackedAllocations untracked;
+    std::lock_guard<std::mutex> guard(_lock);
+    auto it = _counters.find(counter);
+    if (it == _counters.end()) it = _counters.emplace(std::string(counter), 0).first;
+    it->second = value;
+}
+
+void Metrics::label(std::string_view name, std::string_view value) {
+    UntrackedAllocations untracked;
+    std::lock_guard<std::mutex> guard(_lock);
+    auto it = _labels.find(name);
+    if (it == _labels.end()) it = _labels.emplace(std::string(name), std::string()).first;
+    it->second = value;
+}
+
+void Metrics::record(SpanRecord span) {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (!threadName.empty()) _threadNames.try_emplace(span.thread, threadName);
+    _spans.push_back(std::move(span));
+}
+
+std::vector<SpanRecord> Metrics::spans() const {
+    std::lock_guard<std::mutex> guard(_lock);
+    return _spans;
+}
+
+std::map<std::string, std::int64_t> Metrics::counters() const {
+    std::lock_guard<std::mutex> guard(_lock);
+    return {_counters.begin(), _counters.end()};
+}
+
+void Metrics::writeJson(std::ostream& out) const {
+    std::lock_guard<std::mutex> guard(_lock);
+    out << "{\"run\":" << jsonString(_runName) << ",\"elapsed_ns\":" << elapsedNs() << ",\"labels\":{";
+    const char* separator = "";
+    for (const auto& [name, value] : _labels) {
+        out << separator << jsonString(name) << ":" << jsonString(value);
+        separator = ",";
+    }
+    out << "},\"counters\":{";
+    separator = "";
+    for (const auto& [name, value] : _counters) {
+        out << separator << jsonString(name) << ":" << value;
+        separator = ",";
+    }
+
+    // Every span, then the totals per path (over all threads and occurrences)
+    out << "},\"spans\":[";
+    std::map<std::string, std::pair<std::uint64_t, std::uint64_t>> stages; // Path: count, total ns
+    separator = "";
+    for (const SpanRecord& span : _spans) {
+        out << separator << "{\"name\":" << jsonString(span.name) << ",\"path\":" << jsonString(span.path)
+            << ",\"thread\":" << span.thread << ",\"depth\":" << span.depth << ",\"start_ns\":" << span.startNs
+            << ",\"duration_ns\":" << span.durationNs;
+        if (span.level == SpanLevel::Trace) out << ",\"trace\":true";
+        writeArgs(out, span, false);
+        if (const auto& allocations = span.allocations) {
+            out << ",\"allocations\":{\"count\":" << allocations->allocations << ",\"bytes\":"
+                << allocations->allocatedBytes << ",\"frees\":" << allocations->frees << ",\"freed_bytes\":"
+                << allocations->freedBytes << ",\"live_bytes\":" << allocations->liveBytes() << "}";
+        }
+        if (span.hardware && !span.hardware->empty()) {
+            out << ",\"hardware\":{";
+            writeHardware(out, *span.hardware);
+            out << "}";
+        }
+        out << "}";
+        separator = ",";
+        auto& stage = stages[span.path];
+        ++stage.first;
+        stage.second += span.durationNs;
+    }
+    out << "],\"stages\":{";
+    separator = "";
+    for (const auto& [path, stage] : stages) {
+        out << separator << jsonString(path) << ":{\"count\":" << stage.first << ",\"total_ns\":" << stage.second << "}";
+        separator = ",";
+    }
+    out << "}}\n";
+}
+
+void Metrics::printSummary(std::ostream& out) const {
+    std::vector<SpanRecord> own;
+    for (const SpanRecord& span : spans()) {
+        if (span.thread == _ownerThread && span.level == SpanLevel::Stage) own.push_back(span);
+    }
+    // Parents end after their children but start before them
+    std::stable_sort(own.begin(), own.end(), [](const SpanRecord& a, const SpanRecord& b) {
+        return a.startNs < b.startNs || (a.startNs == b.startNs && a.depth < b.depth);
+    });
+    for (const SpanRecord& span : own) {
+        char duration[32];
+        std::snprintf(duration, sizeof duration, "%.3f", static_cast<double>(span.durationNs) / 1e6);
+        out << std::string(2 * span.depth, ' ') << span.name << " took " << duration << " ms";
+        if (const auto& allocations = span.allocations) {
+            out << " (" << allocations->allocations << " allocations, " << formatBytes(allocations->allocatedBytes)
+                << ", " << (allocations->liveBytes() >= 0 ? "+" : "") << formatBytes(allocations->liveBytes())
+                << " live)";
+        }
+        if (const auto& hardware = span.hardware; hardware && !hardware->empty()) {
+            out << " [";
+            const char* separator = "";
+            if (hardware->partial) {
+                out << "partial";
+                separator = ": ";
+            }
+            if (auto ipc = hardware->ipc()) {
+                char text[32];
+                std::snprintf(text, sizeof text, "IPC %.2f", *ipc);
+                out << text;
+                separator = ", ";
+            }
+            for (size_t i = 0; i < perfEventCount; ++i) {
+                auto event = static_cast<PerfEvent>(i);
+                if (!hardware->has(event)) continue;
+                std::string name = perfEventName(event);
+                std::replace(name.begin(), name.end(), '_', ' ');
+                out << separator << formatCount((*hardware)[event]) << " " << name;
+                separator = ", ";
+            }
+            out << "]";
+        }
+        out << ".\n";
+    }
+}
+
+void Metrics::writeChromeTrace(std::ostream& out) const {
+    std::lock_guard<std::mutex> guard(_lock);
+    // Run description, shown in the trace viewer's metadata
+    out << "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"run\":" << jsonString(_runName);
+    for (const auto& [name, value] : _labels) out << "," << jsonString(name) << ":" << jsonString(value);
+    for (const auto& [name, value] : _counters) out << "," << jsonString(name) << ":" << value;
+    out << "},\"traceEvents\":[\n";
+
+    // Process and thread names
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":"
+        << jsonString(_runName.empty() ? "run" : _runName) << "}}";
+    std::map<unsigned, std::string> threads;
+    for (const SpanRecord& span : _spans) threads.emplace(span.thread, "");
+    for (auto& [thread, name] : threads) {
+        auto named = _threadNames.find(thread);
+        name = named != _threadNames.end() ? named->second
+             : thread == _ownerThread      ? "caller"
+                                           : "thread " + std::to_string(thread);
+        out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread
+            << ",\"args\":{\"name\":" << jsonString(name) << "}}";
+    }
+
+    // One complete event per span, in microseconds
+    for (const SpanRecord& span : _spans) {
+        out << ",\n{\"name\":" << jsonString(span.name) << ",\"cat\":"
+            << (span.level == SpanLevel::Stage ? "\"stage\"" : "\"trace\"") << ",\"ph\":\"X\",\"pid\":1,\"tid\":"
+            << span.thread << ",\"ts\":" << jsonNumber(static_cast<double>(span.startNs) / 1e3)
+            << ",\"dur\":" << jsonNumber(static_cast<double>(span.durationNs) / 1e3);
+        writeArgs(out, span, true);
+        out << "}";
+    }
+    out << "\n]}\n";
+}
+
+MetricsScope::MetricsScope(Metrics& metrics)
+    : _previous(Metrics::_active.exchange(&metrics, std::memory_order_acq_rel)),
+      _previousTracing(Metrics::_tracing.exchange(metrics.tracing() ? &metrics : nullptr, std::memory_order_acq_rel)) {
+}
+
+MetricsScope::~MetricsScope() {
+    Metrics::_tracing.store(_previousTracing, std::memory_order_release);
+    Metrics::_active.store(_previous, std::memory_order_release);
+}
+
+void ScopedSpan::start(std::string_view name, SpanLevel level) {
+    UntrackedAllocations untracked; // Not the span's own bookkeeping
+    ScopedSpan*& current = SpanContext::_current;
+    _parent = current && current->_record ? current : nullptr; // Unless stopped on its own thread meanwhile
+    SpanRecord& record = _record.emplace();
+    record.name = name;
+    record.path = _parent ? _parent->_record->path + "/" + record.name : record.name;
+    record.thread = Metrics::threadId();
+    record.depth = _parent ? _parent->_record->depth + 1 : 0;
+    record.level = level;
+    current = this;
+    if (AllocationTracker::enabled()) {
+        record.allocations = level == SpanLevel::Stage ? AllocationTracker::totalStats() : AllocationTracker::threadStats();
+    }
+    if (const PerfCounters* counters = _metrics->perfCounters(); counters && level == SpanLevel::Stage) {
+        record.hardware = counters->read();
+    }
+    record.startNs = _metrics->elapsedNs();
+}
+
+void ScopedSpan::finish() {
+    _record->durationNs = _metrics->elapsedNs() - _record->startNs;
+    if (auto& hardware = _record->hardware) *hardware = _metrics->perfCounters()->read() - *hardware;
+    UntrackedAllocations untracked;
+    if (auto& allocations = _record->allocations) {
+        *allocations = (_record->level == SpanLevel::Stage ? AllocationTracker::totalStats()
+                                                           : AllocationTracker::threadStats()) - *allocations;
+    }
+    if (SpanContext::_current == this) SpanContext::_current = _parent;
+    _metrics->record(std::move(*_record));
+    _record.reset();
+    _metrics = nullptr;
+}
+
+void ScopedSpan::addArg(std::string_view name, std::int64_t value) {
+    UntrackedAllocations untracked;
+    _record->args.emplace_back(name, value);
+}
+
+std::string jsonString(std::string_view s) {
+    std::string quoted = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escape[8];
+            std::snprintf(escape, sizeof escape, "\\u%04x", static_cast<unsigned>(c));
+            quoted += escape;
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+std::string jsonNumber(double x) {
+    if (!std::isfinite(x)) return "null";
+    char text[32];
+    std::snprintf(text, sizeof text, "%.3f", x);
+    return text;
+}
@@ -0,0 +1,189 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "allocationTracker.h"
+#include "perfCounters.h"
+#include "spanContext.h"
+
+// Stage metrics of one run: timed spans and counters, reported as a single JSON object
+// Spans are measured with steady_clock in nanoseconds. A span opened while another one is open
+// on the same thread is nested in it, and a task forked to the thread pool nests its spans in the
+// span that forked it, whichever thread runs the task; every span records the thread that ran it,
+// so stages that run on worker threads are attributed to those threads. Counters are named integers (bytes
+// read, words, nodes allocated, ...).
+// Spans and counters record into the active registry (see MetricsScope), and cost a pointer check
+// when there is none. All members are thread-safe.
+// While allocations are tracked (see AllocationTrackingScope), every span also records the heap
+// allocations made during it: stage spans those of all threads (a stage's worker tasks included),
+// trace spans those of their own thread.
+// A registry given hardware counters (see setPerfCounters) reads them around every stage span.
+// A registry created with tracing on also records trace spans: fine-grained spans per chunk, per
+// task and per merge, meant for a timeline view (see writeChromeTrace) rather than for totals.
+
+// Level of a span: stages are recorded by every active registry, trace spans only when tracing
+enum class SpanLevel { Stage, Trace };
+
+// One finished span
+struct SpanRecord {
+    std::string name; // Name of the stage
+    std::string path; // Names of the enclosing spans on the same thread and of this one, joined by '/'
+    unsigned thread = 0; // Id of the thread that ran the span (see Metrics::threadId)
+    unsigned depth = 0; // Number of enclosing spans on that thread
+    SpanLevel level = SpanLevel::Stage;
+    std::uint64_t startNs = 0; // Start, relative to the creation of the registry
+    std::uint64_t durationNs = 0;
+    std::vector<std::pair<std::string, std::int64_t>> args; // Details (bytes, words, ...), shown in traces
+    std::optional<AllocationStats> allocations; // Allocations during the span, if they were tracked
+    std::optional<PerfReading> hardware; // Hardware counters during the span (stages only), if read
+};
+
+// Registry of the spans and counters of one run
+class Metrics {
+public:
+    // Constructor: starts the run's clock; with tracing, trace spans are recorded too
+    explicit Metrics(std::string runName = "", bool tracing = false);
+
+    Metrics(Metrics const&) = delete;
+    Metrics& operator=(Metrics const&) = delete;
+
+    // Registry that spans of the given level and counters record into, or nullptr
+    static Metrics* active(SpanLevel level = SpanLevel::Stage) {
+        return (level == SpanLevel::Stage ? _active : _tracing).load(std::memory_order_acquire);
+    }
+
+    // Whether trace spans are recorded
+    bool tracing() const { return _traced; }
+
+    // Read these counters around every stage span (nullptr: none); to be set before any span starts
+    void setPerfCounters(const PerfCounters* counters) { _perfCounters = counters; }
+    const PerfCounters* perfCounters() const { return _perfCounters; }
+
+    // Small id of the calling thread, unique within the process (ids are given in order of first use)
+    static unsigned threadId();
+
+    // Name the calling thread in traces (unnamed threads are shown by id)
+    static void nameThread(std::string name);
+
+    // Nanoseconds since the registry was created
+    std::uint64_t elapsedNs() const;
+
+    // Add to a counter (created at 0), or set its value
+    void add(std::string_view counter, std::int64_t delta);
+    void set(std::string_view counter, std::int64_t value);
+
+    // Attach a descriptive string to the run (input file, mode, ...)
+    void label(std::string_view name, std::string_view value);
+
+    // Record a finished span (normally done by ScopedSpan)
+    void record(SpanRecord span);
+
+    // Snapshots, spans in order of completion
+    std::vector<SpanRecord> spans() const;
+    std::map<std::string, std::int64_t> counters() const;
+
+    // Write the run as one JSON object on one line: name, labels, counters, every span, and the spans
+    // aggregated per path ("stages": number of occurrences and total duration)
+    void writeJson(std::ostream& out) const;
+
+    // Print the stage spans of the thread that created the registry, in order, indented by nesting,
+    // with their allocations and hardware counters if they were measured
+    void printSummary(std::ostream& out) const;
+
+    // Write the spans as a Chrome trace (trace-event JSON: chrome://tracing, ui.perfetto.dev),
+    // one complete event per span on the timeline of its thread, with the counters as metadata
+    void writeChromeTrace(std::ostream& out) const;
+
+private:
+    friend class MetricsScope;
+
+    // Active registry, and the same registry again if it traces
+    static inline std::atomic<Metrics*> _active{nullptr};
+    static inline std::atomic<Metrics*> _tracing{nullptr};
+
+    const std::string _runName;
+    const bool _traced;
+    const std::chrono::steady_clock::time_point _start;
+    const unsigned _ownerThread; // Thread that created the registry
+    const PerfCounters* _perfCounters = nullptr;
+    mutable std::mutex _lock;
+    std::vector<SpanRecord> _spans;
+    std::map<std::string, std::int64_t, std::less<>> _counters;
+    std::map<std::string, std::string, std::less<>> _labels;
+    std::map<unsigned, std::string> _threadNames; // Names of the named threads that recorded spans
+};
+
+// Makes a registry the active one for its lifetime (restoring the previous one afterwards)
+// Only one registry is active at a time in the whole process, whichever thread activated it.
+class MetricsScope {
+public:
+    explicit MetricsScope(Metrics& metrics);
+    ~MetricsScope();
+
+    MetricsScope(MetricsScope const&) = delete;
+    MetricsScope& operator=(MetricsScope const&) = delete;
+
+private:
+    Metrics* _previous;
+    Metrics* _previousTracing;
+};
+
+// Times the enclosing scope (or until stop()) as a span of the active registry, if any
+// When nothing records spans of its level, a span costs one load and a branch predicted not taken.
+class ScopedSpan {
+public:
+    explicit ScopedSpan(std::string_view name, SpanLevel level = SpanLevel::Stage)
+        : _metrics(Metrics::active(level)) {
+        if (_metrics) [[unlikely]] start(name, level);
+    }
+
+    ScopedSpan(ScopedSpan const&) = delete;
+    ScopedSpan& operator=(ScopedSpan const&) = delete;
+
+    // Destructor: ends the span if stop() was not called
+    ~ScopedSpan() {
+        if (_metrics) [[unlikely]] finish();
+    }
+
+    // Attach a detail to the span (ignored when the span is not recorded)
+    void arg(std::string_view name, std::int64_t value) {
+        if (_metrics) [[unlikely]] addArg(name, value);
+    }
+
+    // End the span now
+    void stop() {
+        if (_metrics) [[unlikely]] finish();
+    }
+
+private:
+    void start(std::string_view name, SpanLevel level);
+    void finish();
+    void addArg(std::string_view name, std::int64_t value);
+
+    Metrics* _metrics; // Registry to record into (nullptr: disabled, or already stopped)
+    ScopedSpan* _parent = nullptr; // Enclosing span on this thread
+    std::optional<SpanRecord> _record; // Only built when recording, so that disabled spans stay trivial
+};
+
+// Add to a counter of the active registry, if any
+inline void countMetric(std::string_view counter, std::int64_t delta) {
+    if (Metrics* metrics = Metrics::active()) [[unlikely]] metrics->add(counter, delta);
+}
+
+// JSON string literal for s
+std::string jsonString(std::string_view s);
+
+// JSON number for x (null for infinities and NaNs, which JSON cannot represent)
+std::string jsonNumber(double x);
+
+#endif // METRICS_H
@@ -0,0 +1,159 @@
+#ifndef NODE_ARENA_H
+#define NODE_ARENA_H
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <memory> // For std::unique_ptr
+#include <new>
+#include <utility>
+#include <vector>
+
+// Slab arena for tree nodes
+// Memory is carved out of large contiguous chunks with a bump pointer. Freed blocks are kept
+// on per-size free lists and reused, and all chunks are released together when the arena dies.
+// An arena is not synchronized: it must only be used by one thread at a time (for example one
+// arena per tree lineage or per worker thread, handed over through a future).
+class NodeArena {
+public:
+    // Constructor: chunkBytes is the size of every contiguous chunk requested from the system
+    explicit NodeArena(std::size_t chunkBytes = 256 * 1024)
+        : _chunkBytes(chunkBytes), _cursor(nullptr), _end(nullptr), _freeLists{} {
+    }
+
+    NodeArena(NodeArena const &) = delete;
+    NodeArena &operator=(NodeArena const &) = delete;
+
+    // Allocate a block of the given size, reusing a freed block of the same size class if possible
+    void *allocate(std::size_t bytes) {
+        std::size_t size = roundUp(bytes);
+        if (size > kMaxBlock) // Oversized blocks bypass the arena
+            return ::operator new(bytes);
+
+        FreeBlock *&head = _freeLists[size / kGranule - 1];
+        if (head) { // Reuse a previously freed block
+            FreeBlock *block = head;
+            head = block->next;
+            return block;
+        }
+        if (static_cast<std::size_t>(_end - _cursor) < size)
+            grow(size);
+        void *block = _cursor; // Bump-allocate from the current chunk
+        _cursor += size;
+        return block;
+    }
+
+    // Return a block to its size-class free list (memory goes back to the system only with the arena)
+    void deallocate(void *p, std::size_t bytes) noexcept {
+        std::size_t size = roundUp(bytes);
+        if (size > kMaxBlock) {
+            ::operator delete(p);
+            return;
+        }
+        FreeBlock *&head = _freeLists[size / kGranule - 1];
+        head = ::new(p) FreeBlock{head};
+    }
+
+    // Number of chunks obtained from the system so far
+    std::size_t chunkCount() const { return _chunks.size(); }
+
+    // Total number of bytes reserved by the arena
+    std::size_t bytesReserved() const { return _chunks.size() * _chunkBytes; }
+
+private:
+    template<typename U>
+    friend class ArenaAllocator;
+
+    // Blocks are multiples of the default new alignment so any node type fits
+    static constexpr std::size_t kGranule = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+    static constexpr std::size_t kMaxBlock = 512;
+
+    // A freed block is reused to link the free list
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    static constexpr std::size_t roundUp(std::size_t bytes) {
+        return (bytes + kGranule - 1) / kGranule * kGranule;
+    }
+
+    // Start a new chunk (the unused tail of the previous chunk is abandoned)
+    void grow(std::size_t size) {
+        std::size_t bytes = _chunkBytes < size ? size : _chunkBytes;
+        _chunks.push_back(std::make_unique_for_overwrite<std::byte[]>(bytes));
+        _cursor = _chunks.back().get();
+        _end = _cursor + bytes;
+    }
+
+    std::size_t _chunkBytes; // Size of each chunk
+    std::vector<std::unique_ptr<std::byte[]>> _chunks; // All chunks owned by the arena
+    std::byte *_cursor; // Next free byte in the current chunk
+    std::byte *_end; // End of the current chunk
+    std::array<FreeBlock *, kMaxBlock / kGranule> _freeLists; // One free list per size class
+    std::size_t _users = 1; // Number of ArenaAllocator copies referring to this arena
+};
+
+// Standard allocator backed by a shared NodeArena
+// Every copy (including the one stored in each node's control block) keeps the arena alive,
+// so the arena is released in bulk once the last tree version using it is destroyed.
+// The arena is only created when the allocator is first used or copied, so that trees constructed
+// empty and then assigned over (or never filled) cost nothing.
+// The user count is not atomic for the same reason the arena is not synchronized.
+template<typename U>
+class ArenaAllocator {
+public:
+    using value_type = U;
+
+    // Default constructor: a fresh arena, created on first use (one arena per tree lineage)
+    ArenaAllocator() noexcept : _arena(nullptr) {
+    }
+
+    // Copy constructor: shares the arena (creating it first, so that the copies share it)
+    ArenaAllocator(ArenaAllocator const &other) : _arena(&other.arena()) {
+        ++_arena->_users;
+    }
+
+    // Rebinding constructor used by std::allocate_shared
+    template<typename V>
+    ArenaAllocator(ArenaAllocator<V> const &other) : _arena(&other.arena()) {
+        ++_arena->_users;
+    }
+
+    ArenaAllocator &operator=(ArenaAllocator other) noexcept {
+        std::swap(_arena, other._arena);
+        return *this;
+    }
+
+    // Destructor: the last user releases the arena and all of its chunks
+    ~ArenaAllocator() {
+        if (NodeArena *arena = std::exchange(_arena, nullptr); arena && --arena->_users == 0)
+            delete arena;
+    }
+
+    U *allocate(std::size_t n) {
+        static_assert(alignof(U) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__, "Over-aligned types are not supported");
+        return static_cast<U *>(arena().allocate(n * sizeof(U)));
+    }
+
+    void deallocate(U *p, std::size_t n) noexcept {
+        _arena->deallocate(p, n * sizeof(U));
+    }
+
+    // Get the arena used by this allocator (created on first use)
+    NodeArena &arena() const {
+        if (!_arena)
+            _arena = new NodeArena();
+        return *_arena;
+    }
+
+    template<typename V>
+    bool operator==(ArenaAllocator<V> const &other) const { return &arena() == &other.arena(); }
+
+private:
+    template<typename V>
+    friend class ArenaAllocator;
+
+    mutable NodeArena *_arena; // Arena shared by all copies of this allocator, null until first used
+};
+
+#endif // NODE_ARENA_H
@@ -0,0 +1,233 @@
+#include "perfCounters.h"
+#include <algorithm>
+#include <cstdint>
+#include <map>
+
+#if defined(__linux__) && __has_include(<linux/perf_event.h>)
+#define PERF_COUNTERS_LINUX 1
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#define PERF_COUNTERS_LINUX 0
+#endif
+
+namespace {
+
+const char* const eventNames[perfEventCount] = {"cycles",      "instructions", "branch_misses", "l1d_misses",
+                                                "llc_misses",  "dtlb_misses",  "page_faults"};
+
+#if PERF_COUNTERS_LINUX
+
+// Whether an event is a hardware one: those are opened as one group per thread, so that the hardware
+// schedules them together and their ratios (IPC) describe the same instructions
+bool grouped(PerfEvent event) {
+    return event != PerfEvent::PageFaults;
+}
+
+// Type and configuration of each event
+perf_event_attr eventAttributes(PerfEvent event) {
+    auto cacheMisses = [](std::uint64_t cache) {
+        return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    };
+    perf_event_attr attr{};
+    attr.size = sizeof attr;
+    attr.type = PERF_TYPE_HARDWARE;
+    switch (event) {
+    case PerfEvent::Cycles: attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+    case PerfEvent::Instructions: attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+    case PerfEvent::BranchMisses: attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+    case PerfEvent::LlcMisses: attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+    case PerfEvent::L1dMisses:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = cacheMisses(PERF_COUNT_HW_CACHE_L1D);
+        break;
+    case PerfEvent::DtlbMisses:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = cacheMisses(PERF_COUNT_HW_CACHE_DTLB);
+        break;
+    case PerfEvent::PageFaults:
+        attr.type = PERF_TYPE_SOFTWARE;
+        attr.config = PERF_COUNT_SW_PAGE_FAULTS;
+        break;
+    }
+    attr.exclude_kernel = 1; // Allowed without privileges, and the kernel's work is not ours to tune
+    attr.exclude_hv = 1;
+    attr.inherit = 1; // Follow the threads started later
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    if (grouped(event)) attr.read_format |= PERF_FORMAT_GROUP;
+    return attr;
+}
+
+// Opens an event for a thread, in the group of the given leader (or as a leader, with -1)
+int openEvent(PerfEvent event, pid_t thread, int leader) {
+    perf_event_attr attr = eventAttributes(event);
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, thread, -1, leader, PERF_FLAG_FD_CLOEXEC));
+}
+
+// Why an event could not be opened
+std::string describeError(int error) {
+    switch (error) {
+    case EACCES:
+    case EPERM: return "access denied (see /proc/sys/kernel/perf_event_paranoid)";
+    case ENOENT:
+    case EOPNOTSUPP: return "not supported by this CPU or virtual machine";
+    case ENOSYS: return "perf_event_open is not available in this kernel";
+    default: return std::strerror(error);
+    }
+}
+
+// Ids of the threads of the process, the calling thread first
+std::vector<pid_t> processThreads() {
+    const pid_t self = static_cast<pid_t>(syscall(SYS_gettid));
+    std::vector<pid_t> threads = {self};
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator("/proc/self/task", error)) {
+        pid_t thread = static_cast<pid_t>(std::stol(entry.path().filename().string()));
+        if (thread != self) threads.push_back(thread);
+    }
+    return threads;
+}
+
+// Count scaled by the fraction of the time the event was enabled that it ran on the hardware
+double scaled(std::uint64_t value, std::uint64_t enabled, std::uint64_t running) {
+    return static_cast<double>(value) * static_cast<double>(enabled) / static_cast<double>(running);
+}
+
+#endif
+
+} // namespace
+
+const char* perfEventName(PerfEvent event) {
+    return eventNames[static_cast<size_t>(event)];
+}
+
+bool PerfReading::empty() const {
+    for (bool counted : valid) {
+        if (counted) return false;
+    }
+    return true;
+}
+
+std::optional<double> PerfReading::ipc() const {
+    if (!has(PerfEvent::Cycles) || !has(PerfEvent::Instructions) || (*this)[PerfEvent::Cycles] <= 0) return std::nullopt;
+    return (*this)[PerfEvent::Instructions] / (*this)[PerfEvent::Cycles];
+}
+
+PerfReading PerfReading::operator-(const PerfReading& before) const {
+    PerfReading difference;
+    difference.partial = partial || before.partial;
+    for (size_t i = 0; i < perfEventCount; ++i) {
+        difference.valid[i] = valid[i] && before.valid[i];
+        if (difference.valid[i]) difference.values[i] = std::max(values[i] - before.values[i], 0.0);
+    }
+    return difference;
+}
+
+PerfReading PerfReading::operator/(double divisor) const {
+    PerfReading quotient = *this;
+    for (double& value : quotient.values) value /= divisor;
+    return quotient;
+}
+
+#if PERF_COUNTERS_LINUX
+
+PerfCounters::PerfCounters() {
+    // An event is available if it opens for the calling thread; other threads may have finished since
+    // they were listed, so failures to open for them are ignored
+    std::map<std::string, std::string> unavailable; // Reason: names of the events
+    const std::vector<pid_t> threads = processThreads();
+    _threads.assign(threads.begin(), threads.end());
+    for (pid_t thread : threads) {
+        std::array<int, perfEventCount> fds;
+        fds.fill(-1);
+        int leader = -1; // First hardware event opened for the thread
+        for (size_t i = 0; i < perfEventCount; ++i) {
+            const bool first = thread == threads.front();
+            if (!first && !_available[i]) continue;
+            const auto event = static_cast<PerfEvent>(i);
+            fds[i] = openEvent(event, thread, grouped(event) ? leader : -1);
+            if (grouped(event) && leader < 0) leader = fds[i];
+            if (first) {
+                _available[i] = fds[i] >= 0;
+                if (!_available[i]) {
+                    std::string& names = unavailable[describeError(errno)];
+                    names += (names.empty() ? "" : ", ") + std::string(eventNames[i]);
+                }
+            }
+        }
+        _fds.push_back(fds);
+    }
+    for (const auto& [reason, names] : unavailable) {
+        _error += (_error.empty() ? "" : "; ") + names + ": " + reason;
+    }
+}
+
+PerfCounters::~PerfCounters() {
+    for (const auto& fds : _fds) {
+        for (int fd : fds) {
+            if (fd >= 0) ::close(fd);
+        }
+    }
+}
+
+PerfReading PerfCounters::read() const {
+    PerfReading reading;
+    reading.valid = _available;
+    for (const auto& fds : _fds) {
+        // The hardware group in one read, through its leader: the events in the order they joined
+        std::array<size_t, perfEventCount> members;
+        size_t memberCount = 0;
+        for (size_t i = 0; i < perfEventCount; ++i) {
+            if (fds[i] >= 0 && grouped(static_cast<PerfEvent>(i))) members[memberCount++] = i;
+        }
+        if (memberCount > 0) {
+            std::uint64_t group[3 + perfEventCount]; // Number of events, time enabled, time running, values
+            const auto size = static_cast<ssize_t>((3 + memberCount) * sizeof(std::uint64_t));
+            // Never scheduled on the hardware if the time running is 0
+            if (::read(fds[members[0]], group, sizeof group) == size && group[0] == memberCount && group[2] != 0) {
+                for (size_t k = 0; k < memberCount; ++k) {
+                    reading.values[members[k]] += scaled(group[3 + k], group[1], group[2]);
+                }
+            }
+        }
+        for (size_t i = 0; i < perfEventCount; ++i) {
+            if (fds[i] < 0 || grouped(static_cast<PerfEvent>(i))) continue;
+            std::uint64_t counts[3]; // Value, time enabled, time running
+            if (::read(fds[i], counts, sizeof counts) != static_cast<ssize_t>(sizeof counts)) continue;
+            if (counts[2] != 0) reading.values[i] += scaled(counts[0], counts[1], counts[2]);
+        }
+    }
+    // Threads started since the counters were opened only add their counts when they finish
+    for (pid_t thread : processThreads()) {
+        if (std::find(_threads.begin(), _threads.end(), thread) == _threads.end()) reading.partial = true;
+    }
+    return reading;
+}
+
+#else
+
+PerfCounters::PerfCounters() : _error("perf_event_open is only available on Linux") {
+}
+
+PerfCounters::~PerfCounters() = default;
+
+PerfReading PerfCounters::read() const {
+    return {};
+}
+
+#endif
+
+bool PerfCounters::available() const {
+    for (bool counted : _available) {
+        if (counted) return true;
+    }
+    return false;
+}
+
+bool PerfCounters::available(PerfEvent event) const {
+    return _available[static_cast<size_t>(event)];
+}
@@ -0,0 +1,75 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <array>
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Hardware performance counters of the whole process, read around stages and benchmark cases
+// The counters are opened with perf_event_open (Linux) for user space only, one per event and per
+// thread that exists when they are opened, the hardware events of a thread as one group that is
+// scheduled as a whole. Threads those threads start later are followed too, but their counts are only
+// added when they finish: a reading taken while such a thread runs misses its counts so far, and is
+// marked partial. Events counted while the hardware was multiplexed between more events than it has
+// counters are scaled by the fraction of time they ran.
+// Counting needs no privilege with perf_event_paranoid <= 2. Events the kernel refuses, or that the
+// CPU (or a virtual machine) does not provide, are unavailable: readings leave them out and error()
+// says why. Elsewhere than on Linux, no event is available.
+
+// Counted events: hardware ones, and page faults (a software event, available wherever perf is)
+enum class PerfEvent { Cycles, Instructions, BranchMisses, L1dMisses, LlcMisses, DtlbMisses, PageFaults };
+constexpr size_t perfEventCount = 7;
+
+// Name of an event in reports (cycles, llc_misses, ...)
+const char* perfEventName(PerfEvent event);
+
+// Counts of the available events, since the counters were opened or between two readings
+struct PerfReading {
+    std::array<double, perfEventCount> values{};
+    std::array<bool, perfEventCount> valid{}; // Whether each event was counted
+    bool partial = false; // Whether threads started after the counters were opened were running (see above)
+
+    bool has(PerfEvent event) const { return valid[static_cast<size_t>(event)]; }
+    double operator[](PerfEvent event) const { return values[static_cast<size_t>(event)]; }
+
+    // Whether no event was counted
+    bool empty() const;
+
+    // Instructions per cycle, if both were counted
+    std::optional<double> ipc() const;
+
+    // Difference of two readings (partial if either is), and counts divided by a number (of repetitions, of operations)
+    PerfReading operator-(const PerfReading& before) const;
+    PerfReading operator/(double divisor) const;
+};
+
+class PerfCounters {
+public:
+    // Constructor: opens the counters for every thread of the process (never throws: events that
+    // cannot be opened are unavailable)
+    PerfCounters();
+    ~PerfCounters();
+
+    PerfCounters(PerfCounters const&) = delete;
+    PerfCounters& operator=(PerfCounters const&) = delete;
+
+    // Whether any event, or the given one, is counted
+    bool available() const;
+    bool available(PerfEvent event) const;
+
+    // Why some events are unavailable (empty if every event is counted)
+    const std::string& error() const { return _error; }
+
+    // Counts of all threads so far
+    PerfReading read() const;
+
+private:
+    std::array<bool, perfEventCount> _available{};
+    std::vector<int> _threads; // Kernel ids of the threads the counters were opened for
+    std::vector<std::array<int, perfEventCount>> _fds; // Per thread, -1 for unavailable events
+    std::string _error;
+};
+
+#endif // PERF_COUNTERS_H
@@ -2,43 +2,209 @@
 #define RED_BLACK_TREE_H
 
 #include <vector>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <cassert>
-#include <memory> // For std::shared_ptr
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <tuple>
+#include <memory> // For std::allocator, std::allocator_traits
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include "threadPool.h"
 
 // Colors for Red-Black Tree
 enum class Color { R, B }; // Enum to define node colors: R = Red, B = Black
 
+// Reference counting policies for tree nodes
+// AtomicRefCount (default) allows versions of a tree to be shared freely between threads.
+// LocalRefCount uses plain integers and is only valid while a tree lineage is confined to one
+// thread at a time: handing a whole tree over to another thread (e.g. when a forked task joins)
+// is fine, reading the same nodes from two threads at once is not.
+struct AtomicRefCount {
+    using Counter = std::atomic<std::size_t>;
+
+    static void increment(Counter &c) { c.fetch_add(1, std::memory_order_relaxed); }
+
+    // Returns true when the last reference is released
+    static bool decrement(Counter &c) { return c.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+
+    // Returns true when exactly one reference exists
+    static bool unique(Counter const &c) { return c.load(std::memory_order_acquire) == 1; }
+};
+
+struct LocalRefCount {
+    using Counter = std::size_t;
+
+    static void increment(Counter &c) { ++c; }
+
+    // Returns true when the last reference is released
+    static bool decrement(Counter &c) { return --c == 0; }
+
+    // Returns true when exactly one reference exists
+    static bool unique(Counter const &c) { return c == 1; }
+};
+
 // Persistent Red-Black Tree
-template<typename T>
+// Alloc is the allocation policy for nodes: std::allocator (default) uses the global heap,
+// ArenaAllocator (nodeArena.h) places all nodes of a tree lineage into one slab arena.
+// RefCount is the node-handle policy: AtomicRefCount (default) or LocalRefCount.
+template<typename T, typename Alloc = std::allocator<T>, typename RefCount = AtomicRefCount>
 class RBTree {
+    struct Node;
+    using NodeAlloc = typename std::allocator_traits<Alloc>::template rebind_alloc<Node>;
+    using NodeTraits = std::allocator_traits<NodeAlloc>;
+
+    // Intrusive reference-counted handle to an immutable node
+    class NodePtr {
+    public:
+        NodePtr() noexcept : _p(nullptr) {
+        }
+
+        // Adopt a freshly created node (its count already accounts for this handle)
+        explicit NodePtr(Node *p) noexcept : _p(p) {
+        }
+
+        NodePtr(NodePtr const &other) noexcept : _p(other._p) {
+            if (_p) RefCount::increment(_p->_refs);
+        }
+
+        NodePtr(NodePtr &&other) noexcept : _p(std::exchange(other._p, nullptr)) {
+        }
+
+        NodePtr &operator=(NodePtr other) noexcept {
+            std::swap(_p, other._p);
+            return *this;
+        }
+
+        // Release the reference and destroy the node when it was the last one
+        ~NodePtr() {
+            if (_p && RefCount::decrement(_p->_refs))
+                Node::destroy(_p);
+        }
+
+        Node const *get() const noexcept { return _p; }
+
+        // Mutable access, only for nodes exclusively owned by a Transient
+        Node *mut() const noexcept { return _p; }
+        Node const *operator->() const noexcept { return _p; }
+        explicit operator bool() const noexcept { return _p != nullptr; }
+
+    private:
+        Node *_p; // Pointer to the shared node
+    };
+
     // Node structure representing a single element in the tree
     struct Node {
-        Node(Color c,
-             std::shared_ptr<const Node> const &lft, // Left child
-             T val, // Value stored in the node
-             std::shared_ptr<const Node> const &rgt) // Right child
-            : _c(c), _lft(lft), _val(val), _rgt(rgt) {
+        // The value is constructed in place from whatever was passed (copied, moved or converted)
+        template<typename V>
+        Node(NodeAlloc const &alloc,
+             Color c,
+             NodePtr const &lft, // Left child
+             V &&val, // Value (or key convertible to T) stored in the node
+             NodePtr const &rgt) // Right child
+            : _refs(1), _c(c), _bh(static_cast<std::uint8_t>(blackHeight(lft) + (c == Color::B ? 1 : 0))),
+              _alloc(alloc), _lft(lft), _val(std::forward<V>(val)), _rgt(rgt) {
         }
 
+        // Allocate and construct a node through the allocation policy
+        template<typename V>
+        static NodePtr create(Alloc const &alloc, Color c, NodePtr const &lft, V &&val, NodePtr const &rgt) {
+            NodeAlloc nodeAlloc(alloc);
+            Node *p = NodeTraits::allocate(nodeAlloc, 1);
+            NodeTraits::construct(nodeAlloc, p, nodeAlloc, c, lft, std::forward<V>(val), rgt);
+            allocations().increment();
+            return NodePtr(p);
+        }
+
+        // Number of nodes created by one thread
+        // Only the owning thread writes its count, so incrementing needs no atomic read-modify-write;
+        // the counts of all threads (and of finished ones) are summed by totalAllocationCount.
+        struct AllocationCount {
+            std::atomic<std::size_t> count{0};
+
+            AllocationCount() {
+                std::lock_guard<std::mutex> guard(registry().lock);
+                registry().live.push_back(this);
+            }
+
+            ~AllocationCount() {
+                std::lock_guard<std::mutex> guard(registry().lock);
+                registry().finished += count.load(std::memory_order_relaxed);
+                std::erase(registry().live, this);
+            }
+
+            void increment() { count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+        };
+
+        // Counts of the running threads, and the sum of the counts of finished threads
+        struct AllocationRegistry {
+            std::mutex lock;
+            std::vector<AllocationCount *> live;
+            std::size_t finished = 0;
+        };
+
+        // Never destroyed: threads may finish during static destruction
+        static AllocationRegistry &registry() {
+            static auto *instance = new AllocationRegistry;
+            return *instance;
+        }
+
+        // Count of the calling thread
+        static AllocationCount &allocations() {
+            thread_local AllocationCount count;
+            return count;
+        }
+
+        // Number of nodes created by all threads
+        static std::size_t totalAllocations() {
+            std::lock_guard<std::mutex> guard(registry().lock);
+            std::size_t total = registry().finished;
+            for (AllocationCount const *count : registry().live) total += count->count.load(std::memory_order_relaxed);
+            return total;
+        }
+
+        // Destroy and deallocate a node whose last reference was released
+        static void destroy(Node *p) {
+            NodeAlloc nodeAlloc(p->_alloc); // Keep the allocator alive past the node's destructor
+            NodeTraits::destroy(nodeAlloc, p);
+            NodeTraits::deallocate(nodeAlloc, p, 1);
+        }
+
+        mutable typename RefCount::Counter _refs; // Number of handles referring to this node
         Color _c; // Color of the node
-        std::shared_ptr<const Node> _lft; // Pointer to the left child
+        std::uint8_t _bh; // Black height of the subtree rooted here (black nodes on any path down)
+        [[no_unique_address]] NodeAlloc _alloc; // Allocator that owns this node's memory
+        NodePtr _lft; // Pointer to the left child
         T _val; // Value stored in this node
-        std::shared_ptr<const Node> _rgt; // Pointer to the right child
+        NodePtr _rgt; // Pointer to the right child
     };
 
-    // Constructor to initialize an RBTree with a given root node
-    explicit RBTree(std::shared_ptr<const Node> const &node)
-        : _root(node) {
+    // Constructor to initialize an RBTree with a given root node and allocator
+    RBTree(NodePtr const &node, Alloc const &alloc)
+        : _alloc(alloc), _root(node) {
+    }
+
+    // Constructor to create a tree with a root node allocated through the given allocator
+    RBTree(Color c, RBTree const &lft, T val, RBTree const &rgt, Alloc const &alloc)
+        : _alloc(alloc), _root(Node::create(alloc, c, lft._root, std::move(val), rgt._root)) {
     }
 
 public:
     // Default constructor to create an empty tree
-    RBTree() : _root(nullptr) {
+    // With an arena allocator every default-constructed tree starts its own lineage
+    explicit RBTree(Alloc const &alloc = Alloc()) : _alloc(alloc), _root(nullptr) {
     }
 
-    // Constructor to create a tree with a root node
+    // Constructor to create a tree with a root node (allocated with the left subtree's allocator)
     RBTree(Color c, RBTree const &lft, T val, RBTree const &rgt)
-        : _root(std::make_shared<const Node>(c, lft._root, val, rgt._root)) {
+        : RBTree(c, lft, std::move(val), rgt, lft._alloc) {
     }
 
     // Check if the tree is empty
@@ -59,124 +225,656 @@ public:
     // Get the left subtree
     RBTree left() const {
         assert(!isEmpty()); // Ensure the tree is not empty
-        return RBTree(_root->_lft);
+        return RBTree(_root->_lft, _alloc);
     }
 
     // Get the right subtree
     RBTree right() const {
         assert(!isEmpty()); // Ensure the tree is not empty
-        return RBTree(_root->_rgt);
+        return RBTree(_root->_rgt, _alloc);
     }
 
+    // Mutable builder for batch construction (see Transient below)
+    class Transient;
+
+    // Get a transient builder starting from this version
+    Transient transient() const;
+
     // Insert a value into the tree and return the updated tree
-    RBTree insert(T x) const {
-        RBTree t = ins(x); // Perform insertion
+    // If the value is already present the original tree is returned: no node is allocated
+    // and the result shares its root with this tree (see isIdentical)
+    // The argument may be any key comparable with T and convertible to it (e.g. a string_view
+    // for a tree of strings): it is only compared on the way down, and converted or moved into
+    // the single new node, so inserting a duplicate never constructs a T
+    template<typename U>
+    RBTree insert(U &&x) const {
+        NodePtr t = ins(_root, std::forward<U>(x)); // Perform insertion
+        if (!t) // Value already exists
+            return *this;
         // Ensure the root of the tree is always black
-        return RBTree(Color::B, t.left(), t.root(), t.right());
+        // The root was just created by ins and is not shared yet, so it is recolored in place
+        // rather than copied (which would copy its value)
+        if (t->_c == Color::R) {
+            t.mut()->_c = Color::B;
+            ++t.mut()->_bh;
+        }
+        return RBTree(std::move(t), _alloc);
+    }
+
+    // Build a tree from a sorted range of unique values in linear time
+    // Exactly one node is allocated per value: the tree is perfectly balanced and only the
+    // nodes on the deepest, incomplete level are red
+    template<std::random_access_iterator It>
+    static RBTree fromSorted(It first, It last, Alloc const &alloc = Alloc()) {
+        assert(isStrictlySorted(first, last)); // Precondition: sorted and deduplicated
+        return RBTree(buildSorted(first, last, 0, redDepth(last - first), alloc, 0), alloc);
+    }
+
+    // Parallel variant of fromSorted: both halves of every range longer than grainSize are
+    // built concurrently. Only stateless (always-equal) allocators such as std::allocator are
+    // safe to use from several threads, so other allocators fall back to the sequential build.
+    template<std::random_access_iterator It>
+    static RBTree fromSortedParallel(It first, It last, Alloc const &alloc = Alloc(), std::size_t grainSize = 1 << 14) {
+        assert(isStrictlySorted(first, last)); // Precondition: sorted and deduplicated
+        if constexpr (!std::allocator_traits<Alloc>::is_always_equal::value)
+            grainSize = static_cast<std::size_t>(last - first) + 1;
+        return RBTree(buildSorted(first, last, 0, redDepth(last - first), alloc, grainSize), alloc);
+    }
+
+    // Join two trees around a middle value in O(|black height difference|)
+    // Precondition: every value in lft < x < every value in rgt
+    static RBTree join(RBTree const &lft, T const &x, RBTree const &rgt) {
+        assert((lft.isEmpty() || lft.max() < x) && (rgt.isEmpty() || x < rgt.min()));
+        return RBTree(lft.joinNodes(lft._root, x, rgt._root), lft._alloc);
+    }
+
+    // Concatenate two trees in O(log n)
+    // Precondition: every value in lft < every value in rgt
+    static RBTree concat(RBTree const &lft, RBTree const &rgt) {
+        assert(lft.isEmpty() || rgt.isEmpty() || lft.max() < rgt.min());
+        return RBTree(lft.join2(lft._root, rgt._root), lft._alloc);
+    }
+
+    // Split the tree around a value: the trees of smaller and of greater values,
+    // and whether the value itself was present
+    std::tuple<RBTree, bool, RBTree> split(T const &x) const {
+        NodePtr lft, rgt;
+        bool found = splitNodes(_root, x, lft, rgt);
+        return {RBTree(lft, _alloc), found, RBTree(rgt, _alloc)};
+    }
+
+    // Default number of nodes above which set operations recurse on both sides in parallel
+    static constexpr std::size_t kParallelGrain = 1 << 12;
+
+    // Union of two trees, built from join and split in O(m log(n/m + 1)) for sizes m <= n
+    // Subtrees shared by both inputs (e.g. two versions of one lineage) are reused by pointer
+    // Subtrees with more than grainSize nodes are processed fork-join in parallel (0: sequential)
+    RBTree unionWith(RBTree const &other, std::size_t grainSize = kParallelGrain) const {
+        return RBTree(unite(_root, other._root, forkBudget(grainSize), grainSize), _alloc);
+    }
+
+    // Values present in both trees
+    RBTree intersect(RBTree const &other, std::size_t grainSize = kParallelGrain) const {
+        return RBTree(intersectNodes(_root, other._root, forkBudget(grainSize), grainSize), _alloc);
+    }
+
+    // Values of this tree that are not in the other tree
+    RBTree difference(RBTree const &other, std::size_t grainSize = kParallelGrain) const {
+        return RBTree(differenceNodes(_root, other._root, forkBudget(grainSize), grainSize), _alloc);
     }
 
+    // Get the smallest value in the tree
+    T const &min() const {
+        assert(!isEmpty()); // Ensure the tree is not empty
+        Node const *node = _root.get();
+        while (node->_lft) node = node->_lft.get();
+        return node->_val;
+    }
+
+    // Get the largest value in the tree
+    T const &max() const {
+        assert(!isEmpty()); // Ensure the tree is not empty
+        Node const *node = _root.get();
+        while (node->_rgt) node = node->_rgt.get();
+        return node->_val;
+    }
+
+    // Check if the tree holds a value equivalent to the key
+    // Like insert, the key only needs to be comparable with T in both directions
+    template<typename K>
+    bool contains(K const &key) const {
+        return findNode(key) != nullptr;
+    }
+
+    // Get a pointer to the value equivalent to the key, or nullptr if there is none
+    template<typename K>
+    T const *find(K const &key) const {
+        Node const *node = findNode(key);
+        return node ? &node->_val : nullptr;
+    }
+
+    // Check if both trees are the very same version (same root node, not just equal values)
+    bool isIdentical(RBTree const &other) const { return _root.get() == other._root.get(); }
+
+    // Number of tree nodes allocated so far by the calling thread (for this tree type)
+    // Comparing the count before and after an operation gives its allocations
+    static std::size_t allocationCount() { return Node::allocations().count.load(std::memory_order_relaxed); }
+
+    // Number of tree nodes allocated so far by all threads (for this tree type)
+    // Includes the nodes built by thread pool tasks, e.g. in parallel insertions and set operations
+    static std::size_t totalAllocationCount() { return Node::totalAllocations(); }
+
     // Retrieve all values in the tree in sorted order
     std::vector<T> getSortedValues() const {
         std::vector<T> result;
-        getSortedValuesHelper(_root, result); // Perform an in-order traversal
+        getSortedValuesHelper(_root.get(), result); // Perform an in-order traversal
         return result;
     }
 
+    // Lazy in-order iterator yielding the values by const reference, without allocating
+    // The pending ancestors live in a fixed-size stack: a red-black tree is at most twice as high
+    // as its black height, which cannot exceed the number of bits of a size. The tree must outlive
+    // its iterators.
+    class const_iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T const *;
+        using reference = T const &;
+
+        // Default constructor: the end iterator
+        const_iterator() = default;
+
+        reference operator*() const { return _stack[_size - 1]->_val; }
+        pointer operator->() const { return &_stack[_size - 1]->_val; }
+
+        // Advance to the in-order successor
+        const_iterator &operator++() {
+            Node const *node = _stack[--_size];
+            pushLeftSpine(node->_rgt.get()); // Successor is the leftmost node of the right subtree
+            return *this;
+        }
+
+        const_iterator operator++(int) {
+            const_iterator old = *this;
+            ++*this;
+            return old;
+        }
+
+        bool operator==(const_iterator const &other) const {
+            return top() == other.top();
+        }
+
+    private:
+        friend class RBTree;
+
+        static constexpr std::size_t kMaxHeight = 2 * std::numeric_limits<std::size_t>::digits + 1;
+
+        explicit const_iterator(Node const *root) { pushLeftSpine(root); }
+
+        // Push a node and all of its left descendants: the last one pushed is the next value
+        void pushLeftSpine(Node const *node) {
+            for (; node; node = node->_lft.get()) {
+                assert(_size < kMaxHeight);
+                _stack[_size++] = node;
+            }
+        }
+
+        Node const *top() const { return _size ? _stack[_size - 1] : nullptr; }
+
+        std::array<Node const *, kMaxHeight> _stack{}; // Ancestors whose value is still pending
+        std::size_t _size = 0; // Number of entries in the stack
+    };
+
+    using iterator = const_iterator;
+
+    // Iterators over the values in sorted order
+    const_iterator begin() const { return const_iterator(_root.get()); }
+    const_iterator end() const { return const_iterator(); }
+
+    // Get the allocator used for new nodes of this tree
+    Alloc getAllocator() const { return _alloc; }
+
 private:
-    std::shared_ptr<const Node> _root; // Root node of the tree
+    [[no_unique_address]] Alloc _alloc; // Allocation policy shared by all versions of this lineage
+    NodePtr _root; // Root node of the tree
+
+    // The helpers below work directly on node handles, so the recursion never materializes
+    // temporary RBTree objects (each of which would copy a handle and the allocator)
 
-    // Helper function to recursively insert a value into the tree
-    RBTree ins(T x) const {
-        if (isEmpty()) // Base case: Create a new red node for the value
-            return RBTree(Color::R, RBTree(), x, RBTree());
+    // Create a node through this tree's allocation policy
+    template<typename V>
+    NodePtr make(Color c, NodePtr const &lft, V &&x, NodePtr const &rgt) const {
+        return Node::create(_alloc, c, lft, std::forward<V>(x), rgt);
+    }
 
-        T y = root(); // Current root value
-        Color c = rootColor(); // Current root color
+    // Helper function to recursively insert a value below the given node
+    // Returns an empty handle when the value already exists, so no ancestor is rebuilt
+    // The key is passed down by reference and only forwarded into the new leaf
+    template<typename U>
+    NodePtr ins(NodePtr const &node, U &&x) const {
+        if (!node) // Base case: Create a new red node for the value
+            return make(Color::R, NodePtr(), std::forward<U>(x), NodePtr());
 
         // Recursively insert into the left or right subtree
-        if (x < y)
-            return balance(c, left().ins(x), y, right()); // Insert into the left subtree
-        else if (y < x)
-            return balance(c, left(), y, right().ins(x)); // Insert into the right subtree
-        else
-            return *this; // Value already exists, no duplicates allowed
+        if (x < node->_val) {
+            NodePtr lft = ins(node->_lft, std::forward<U>(x)); // Insert into the left subtree
+            return lft ? balance(node->_c, lft, node->_val, node->_rgt) : NodePtr();
+        } else if (node->_val < x) {
+            NodePtr rgt = ins(node->_rgt, std::forward<U>(x)); // Insert into the right subtree
+            return rgt ? balance(node->_c, node->_lft, node->_val, rgt) : NodePtr();
+        } else {
+            return NodePtr(); // Value already exists, no duplicates allowed
+        }
+    }
+
+    // Find the node holding a value equivalent to the key (neither compares less than the other)
+    template<typename K>
+    Node const *findNode(K const &key) const {
+        Node const *node = _root.get();
+        while (node) {
+            if (key < node->_val)
+                node = node->_lft.get();
+            else if (node->_val < key)
+                node = node->_rgt.get();
+            else
+                return node;
+        }
+        return nullptr;
     }
 
     // Helper function to balance the tree to maintain Red-Black Tree properties
-    static RBTree balance(Color c, RBTree const &lft, T x, RBTree const &rgt) {
+    NodePtr balance(Color c, NodePtr const &lft, T const &x, NodePtr const &rgt) const {
         // Case 1: Check and resolve violations for doubled left red nodes
         // This occurs when the left child and its left child are both red.
         // Fix: Rotate right and recolor the nodes to restore balance.
-        if (c == Color::B && lft.doubledLeft()) {
-            return RBTree(
+        if (c == Color::B && doubledLeft(lft)) {
+            return make(
                 Color::R, // Recolor the new root as red
-                lft.left().paint(Color::B), // Recolor the left child's left subtree as black
-                lft.root(), // Promote the left child to root
-                RBTree(Color::B, lft.right(), x, rgt) // Balance the right subtree
+                paint(lft->_lft, Color::B), // Recolor the left child's left subtree as black
+                lft->_val, // Promote the left child to root
+                make(Color::B, lft->_rgt, x, rgt) // Balance the right subtree
             );
         }
         // Case 2: Check and resolve violations for left-right red nodes (zig-zag pattern)
         // This occurs when the left child is red and its right child is also red.
         // Fix: Rotate the left child leftward, reducing the problem to Case 1.
-        else if (c == Color::B && lft.doubledRight()) {
-            return RBTree(
+        else if (c == Color::B && doubledRight(lft)) {
+            return make(
                 Color::R, // Recolor the new root as red
-                RBTree(Color::B, lft.left(), lft.root(), lft.right().left()), // Rotate left child leftward
-                lft.right().root(), // Promote the left child's right child as new root
-                RBTree(Color::B, lft.right().right(), x, rgt) // Balance the right subtree
+                make(Color::B, lft->_lft, lft->_val, lft->_rgt->_lft), // Rotate left child leftward
+                lft->_rgt->_val, // Promote the left child's right child as new root
+                make(Color::B, lft->_rgt->_rgt, x, rgt) // Balance the right subtree
             );
         }
         // Case 3: Check and resolve violations for right-left red nodes (zig-zag pattern)
         // This occurs when the right child is red and its left child is also red.
         // Fix: Rotate the right child rightward, reducing the problem to Case 4.
-        else if (c == Color::B && rgt.doubledLeft()) {
-            return RBTree(
+        else if (c == Color::B && doubledLeft(rgt)) {
+            return make(
                 Color::R, // Recolor the new root as red
-                RBTree(Color::B, lft, x, rgt.left().left()), // Balance the left subtree
-                rgt.left().root(), // Promote the right child's left child as new root
-                RBTree(Color::B, rgt.left().right(), rgt.root(), rgt.right()) // Rotate right subtree
+                make(Color::B, lft, x, rgt->_lft->_lft), // Balance the left subtree
+                rgt->_lft->_val, // Promote the right child's left child as new root
+                make(Color::B, rgt->_lft->_rgt, rgt->_val, rgt->_rgt) // Rotate right subtree
             );
         }
         // Case 4: Check and resolve violations for doubled right red nodes
         // This occurs when the right child and its right child are both red.
         // Fix: Rotate left and recolor the nodes to restore balance.
-        else if (c == Color::B && rgt.doubledRight()) {
-            return RBTree(
+        else if (c == Color::B && doubledRight(rgt)) {
+            return make(
                 Color::R, // Recolor the new root as red
-                RBTree(Color::B, lft, x, rgt.left()), // Balance the left subtree
-                rgt.root(), // Promote the right child to root
-                rgt.right().paint(Color::B) // Recolor the right child's right subtree as black
+                make(Color::B, lft, x, rgt->_lft), // Balance the left subtree
+                rgt->_val, // Promote the right child to root
+                paint(rgt->_rgt, Color::B) // Recolor the right child's right subtree as black
             );
         }
         // Default Case: If no violations are found, return the tree as-is
         else {
-            return RBTree(c, lft, x, rgt); // No balancing is needed
+            return make(c, lft, x, rgt); // No balancing is needed
         }
     }
 
-    // Check if the left subtree has doubled red nodes
-    bool doubledLeft() const {
-        return !isEmpty() && rootColor() == Color::R && !left().isEmpty() && left().rootColor() == Color::R;
+    // Check if the node and its left child are both red
+    static bool doubledLeft(NodePtr const &node) {
+        return node && node->_c == Color::R && node->_lft && node->_lft->_c == Color::R;
     }
 
-    // Check if the right subtree has doubled red nodes
-    bool doubledRight() const {
-        return !isEmpty() && rootColor() == Color::R && !right().isEmpty() && right().rootColor() == Color::R;
+    // Check if the node and its right child are both red
+    static bool doubledRight(NodePtr const &node) {
+        return node && node->_c == Color::R && node->_rgt && node->_rgt->_c == Color::R;
     }
 
-    // Paint the root of the tree with a new color
-    RBTree paint(Color c) const {
-        assert(!isEmpty()); // Ensure the tree is not empty
-        return RBTree(c, left(), root(), right());
+    // Paint the node with a new color
+    NodePtr paint(NodePtr const &node, Color c) const {
+        assert(node); // Ensure the tree is not empty
+        return make(c, node->_lft, node->_val, node->_rgt);
+    }
+
+    // Black height of a subtree (an empty subtree has black height 0)
+    static int blackHeight(NodePtr const &node) { return node ? node->_bh : 0; }
+
+    // Check if a subtree has a red root
+    static bool isRed(NodePtr const &node) { return node && node->_c == Color::R; }
+
+    // Join helper: lft < x < rgt, the result may have a red root
+    NodePtr joinNodes(NodePtr lft, T const &x, NodePtr rgt) const {
+        // A red root is painted black first so the smaller tree can hang below a red node
+        if (blackHeight(lft) > blackHeight(rgt) && isRed(rgt)) rgt = paint(rgt, Color::B);
+        if (blackHeight(rgt) > blackHeight(lft) && isRed(lft)) lft = paint(lft, Color::B);
+
+        if (blackHeight(lft) > blackHeight(rgt)) {
+            NodePtr t = joinRight(lft, x, rgt);
+            // A red-red violation can only remain at the root, where it is fixed by painting it black
+            return isRed(t) && isRed(t->_rgt) ? paint(t, Color::B) : t;
+        }
+        if (blackHeight(rgt) > blackHeight(lft)) {
+            NodePtr t = joinLeft(lft, x, rgt);
+            return isRed(t) && isRed(t->_lft) ? paint(t, Color::B) : t;
+        }
+        // Equal black heights: the value becomes the new root
+        return make(isRed(lft) || isRed(rgt) ? Color::B : Color::R, lft, x, rgt);
+    }
+
+    // Walk down the right spine of the taller tree until the black heights match, hang the
+    // smaller tree there under a new red node and rebalance on the way up, like an insertion
+    NodePtr joinRight(NodePtr const &lft, T const &x, NodePtr const &rgt) const {
+        if (!isRed(lft) && blackHeight(lft) == blackHeight(rgt))
+            return make(Color::R, lft, x, rgt);
+        return balance(lft->_c, lft->_lft, lft->_val, joinRight(lft->_rgt, x, rgt));
+    }
+
+    // Mirror image of joinRight, walking down the left spine of the taller right tree
+    NodePtr joinLeft(NodePtr const &lft, T const &x, NodePtr const &rgt) const {
+        if (!isRed(rgt) && blackHeight(rgt) == blackHeight(lft))
+            return make(Color::R, lft, x, rgt);
+        return balance(rgt->_c, joinLeft(lft, x, rgt->_lft), rgt->_val, rgt->_rgt);
+    }
+
+    // Split helper: fills lft/rgt with the values below/above x and returns whether x was found
+    bool splitNodes(NodePtr const &node, T const &x, NodePtr &lft, NodePtr &rgt) const {
+        if (!node) { // Base case: nothing to split
+            lft = rgt = NodePtr();
+            return false;
+        }
+        if (x < node->_val) {
+            NodePtr inner;
+            bool found = splitNodes(node->_lft, x, lft, inner);
+            rgt = joinNodes(inner, node->_val, node->_rgt); // Everything right of x
+            return found;
+        }
+        if (node->_val < x) {
+            NodePtr inner;
+            bool found = splitNodes(node->_rgt, x, inner, rgt);
+            lft = joinNodes(node->_lft, node->_val, inner); // Everything left of x
+            return found;
+        }
+        lft = node->_lft; // Found: the children are already the two halves
+        rgt = node->_rgt;
+        return true;
+    }
+
+    // Concatenate two trees without a middle value (every value in lft < every value in rgt)
+    NodePtr join2(NodePtr const &lft, NodePtr const &rgt) const {
+        if (!lft) return rgt;
+        if (!rgt) return lft;
+        NodePtr rest;
+        T const &last = splitLast(lft, rest); // The largest value of lft becomes the middle value
+        return joinNodes(rest, last, rgt);
+    }
+
+    // Remove the largest value of a non-empty subtree: fills rest and returns the value
+    T const &splitLast(NodePtr const &node, NodePtr &rest) const {
+        if (!node->_rgt) {
+            rest = node->_lft;
+            return node->_val;
+        }
+        NodePtr inner;
+        T const &last = splitLast(node->_rgt, inner);
+        rest = joinNodes(node->_lft, node->_val, inner);
+        return last;
+    }
+
+    // Set operations may only fork when concurrent updates of shared nodes are safe:
+    // atomic reference counts and a stateless allocator
+    static constexpr bool kThreadSafe =
+            std::is_same_v<RefCount, AtomicRefCount> && std::allocator_traits<Alloc>::is_always_equal::value;
+
+    // How many nested levels of the recursion may still fork (enough to occupy every core)
+    static int forkBudget(std::size_t grainSize) {
+        if (!kThreadSafe || grainSize == 0) return 0; // A grain size of 0 disables forking
+        return static_cast<int>(std::bit_width(ThreadPool::global().workerCount())) + 1;
+    }
+
+    // Decide whether to fork on a subtree: a subtree of black height h has at least 2^h - 1 nodes
+    static bool shouldFork(NodePtr const &node, int forks, std::size_t grainSize) {
+        return forks > 0 && (std::size_t{1} << blackHeight(node)) > grainSize;
+    }
+
+    // Run two independent computations, the first one forked on the thread pool when parallel is true
+    template<typename F, typename G>
+    static std::pair<NodePtr, NodePtr> forkJoin(bool parallel, F const &first, G const &second) {
+        if (!parallel) {
+            NodePtr a = first();
+            return {std::move(a), second()};
+        }
+        NodePtr a, b;
+        parallelInvoke([&] { b = second(); }, [&] { a = first(); });
+        return {std::move(a), std::move(b)};
+    }
+
+    // Union helper: split the second tree by the first tree's root and recurse on both sides
+    NodePtr unite(NodePtr const &a, NodePtr const &b, int forks, std::size_t grainSize) const {
+        if (a.get() == b.get()) return a; // Shared subtree (or both empty): reuse it as is
+        if (!a) return b;
+        if (!b) return a;
+        NodePtr lft, rgt;
+        splitNodes(b, a->_val, lft, rgt);
+        auto [l, r] = forkJoin(shouldFork(a, forks, grainSize),
+                               [&] { return unite(a->_lft, lft, forks - 1, grainSize); },
+                               [&] { return unite(a->_rgt, rgt, forks - 1, grainSize); });
+        return joinNodes(l, a->_val, r);
+    }
+
+    // Intersection helper: keep the first tree's root only if the second tree contains it
+    NodePtr intersectNodes(NodePtr const &a, NodePtr const &b, int forks, std::size_t grainSize) const {
+        if (a.get() == b.get()) return a; // Shared subtree (or both empty): reuse it as is
+        if (!a || !b) return NodePtr();
+        NodePtr lft, rgt;
+        bool found = splitNodes(b, a->_val, lft, rgt);
+        auto [l, r] = forkJoin(shouldFork(a, forks, grainSize),
+                               [&] { return intersectNodes(a->_lft, lft, forks - 1, grainSize); },
+                               [&] { return intersectNodes(a->_rgt, rgt, forks - 1, grainSize); });
+        return found ? joinNodes(l, a->_val, r) : join2(l, r);
+    }
+
+    // Difference helper: split the first tree by the second tree's root, dropping that value
+    NodePtr differenceNodes(NodePtr const &a, NodePtr const &b, int forks, std::size_t grainSize) const {
+        if (a.get() == b.get() || !a) return NodePtr(); // Shared subtree: nothing left
+        if (!b) return a;
+        NodePtr lft, rgt;
+        splitNodes(a, b->_val, lft, rgt);
+        auto [l, r] = forkJoin(shouldFork(b, forks, grainSize),
+                               [&] { return differenceNodes(lft, b->_lft, forks - 1, grainSize); },
+                               [&] { return differenceNodes(rgt, b->_rgt, forks - 1, grainSize); });
+        return join2(l, r);
+    }
+
+    // Check that a range is strictly increasing (sorted without duplicates)
+    template<typename It>
+    static bool isStrictlySorted(It first, It last) {
+        return std::adjacent_find(first, last, [](T const &a, T const &b) { return !(a < b); }) == last;
+    }
+
+    // Depth of the deepest level in a midpoint-built tree of n nodes, if that level is incomplete
+    // Levels above it are full, so coloring it red keeps every path at the same black height
+    static int redDepth(std::ptrdiff_t n) {
+        return static_cast<int>(std::bit_width(static_cast<std::size_t>(n) + 1)) - 1;
+    }
+
+    // Recursive helper for fromSorted: the middle value becomes the root of each range
+    // Ranges longer than grainSize build their left half as a forked task (grainSize 0 means never)
+    template<typename It>
+    static NodePtr buildSorted(It first, It last, int depth, int red, Alloc const &alloc, std::size_t grainSize) {
+        if (first == last) return NodePtr(); // Base case: empty range
+        It mid = first + (last - first) / 2;
+        Color c = depth == red ? Color::R : Color::B;
+
+        if (grainSize != 0 && static_cast<std::size_t>(last - first) > grainSize) {
+            NodePtr lft, rgt;
+            parallelInvoke([&] { rgt = buildSorted(mid + 1, last, depth + 1, red, alloc, grainSize); },
+                           [&] { lft = buildSorted(first, mid, depth + 1, red, alloc, grainSize); });
+            return Node::create(alloc, c, lft, *mid, rgt);
+        }
+        NodePtr lft = buildSorted(first, mid, depth + 1, red, alloc, grainSize);
+        NodePtr rgt = buildSorted(mid + 1, last, depth + 1, red, alloc, grainSize);
+        return Node::create(alloc, c, lft, *mid, rgt);
     }
 
     // Recursive helper function for in-order traversal to collect sorted values
-    static void getSortedValuesHelper(std::shared_ptr<const Node> const &node, std::vector<T> &result) {
+    static void getSortedValuesHelper(Node const *node, std::vector<T> &result) {
         if (!node) return; // Base case: empty node
-        getSortedValuesHelper(node->_lft, result); // Traverse left subtree
+        getSortedValuesHelper(node->_lft.get(), result); // Traverse left subtree
         result.push_back(node->_val); // Add root value
-        getSortedValuesHelper(node->_rgt, result); // Traverse right subtree
+        getSortedValuesHelper(node->_rgt.get(), result); // Traverse right subtree
+    }
+};
+
+// Transient (mutable builder) for batch construction, in the spirit of Clojure's transients
+// A node is exclusively owned by the builder when every handle on the path from the builder's root
+// to it is the only reference to its node. Such nodes are updated and rebalanced in place; shared
+// nodes are path-copied as in RBTree::insert, so versions shared with other trees (including every
+// tree returned by persistent()) are never modified. Inserting into a fresh builder therefore
+// allocates exactly one node per new value.
+template<typename T, typename Alloc, typename RefCount>
+class RBTree<T, Alloc, RefCount>::Transient {
+public:
+    // Constructor: starts from an existing version (an empty tree for a fresh builder)
+    explicit Transient(RBTree const &tree = RBTree()) : _alloc(tree._alloc), _root(tree._root) {
+    }
+
+    // Insert a value in place and return the builder for chaining
+    // As with RBTree::insert, the key is forwarded into the new node and never copied on the way
+    template<typename U>
+    Transient &insert(U &&x) {
+        NodePtr t = ins(_root, std::forward<U>(x), true);
+        if (!t) // Value already exists
+            return *this;
+        paint(t, Color::B); // Ensure the root of the tree is always black
+        _root = std::move(t);
+        return *this;
+    }
+
+    // Freeze the current contents into a persistent tree
+    // The builder stays usable: the returned version shares the root, so later inserts copy its path
+    RBTree persistent() const { return RBTree(_root, _alloc); }
+
+private:
+    Alloc _alloc; // Allocation policy for new nodes
+    NodePtr _root; // Root node of the tree being built
+
+    // Recompute the black height of an owned node after its children or color changed
+    static void update(Node *node) {
+        node->_bh = static_cast<std::uint8_t>(blackHeight(node->_lft) + (node->_c == Color::B ? 1 : 0));
+    }
+
+    // Recolor an owned node
+    static void paint(NodePtr const &node, Color c) {
+        node.mut()->_c = c;
+        update(node.mut());
+    }
+
+    // Helper function to recursively insert a value below the given node
+    // `owned` tells whether every ancestor is exclusively owned by this builder. The result is
+    // always exclusively owned, or an empty handle when the value already exists.
+    template<typename U>
+    NodePtr ins(NodePtr const &node, U &&x, bool owned) const {
+        if (!node) // Base case: Create a new red node for the value
+            return Node::create(_alloc, Color::R, NodePtr(), std::forward<U>(x), NodePtr());
+
+        owned = owned && RefCount::unique(node->_refs); // Checked before any new handle exists
+        bool toLeft = x < node->_val;
+        if (!toLeft && !(node->_val < x))
+            return NodePtr(); // Value already exists, no duplicates allowed
+
+        NodePtr child = ins(toLeft ? node->_lft : node->_rgt, std::forward<U>(x), owned);
+        if (!child)
+            return NodePtr();
+
+        // Update the node in place when owned, otherwise work on a fresh copy
+        NodePtr g = owned ? node : Node::create(_alloc, node->_c, node->_lft, node->_val, node->_rgt);
+        (toLeft ? g.mut()->_lft : g.mut()->_rgt) = std::move(child);
+        return rebalance(std::move(g));
+    }
+
+    // In-place counterpart of RBTree::balance: the same four cases, but the grandparent, the red
+    // child and the red grandchild (all on the insertion path, hence owned) are relinked instead
+    // of being reallocated
+    static NodePtr rebalance(NodePtr g) {
+        Node *gn = g.mut();
+        if (gn->_c == Color::B && doubledLeft(gn->_lft)) {
+            // Case 1: left child and its left child are red, rotate right
+            NodePtr p = std::move(gn->_lft);
+            Node *pn = p.mut();
+            paint(pn->_lft, Color::B);
+            gn->_lft = std::move(pn->_rgt);
+            update(gn);
+            pn->_rgt = std::move(g);
+            pn->_c = Color::R;
+            update(pn);
+            return p;
+        } else if (gn->_c == Color::B && doubledRight(gn->_lft)) {
+            // Case 2: left child and its right child are red, the grandchild becomes the root
+            NodePtr p = std::move(gn->_lft);
+            Node *pn = p.mut();
+            NodePtr c = std::move(pn->_rgt);
+            Node *cn = c.mut();
+            pn->_rgt = std::move(cn->_lft);
+            pn->_c = Color::B;
+            update(pn);
+            gn->_lft = std::move(cn->_rgt);
+            update(gn);
+            cn->_lft = std::move(p);
+            cn->_rgt = std::move(g);
+            cn->_c = Color::R;
+            update(cn);
+            return c;
+        } else if (gn->_c == Color::B && doubledLeft(gn->_rgt)) {
+            // Case 3: right child and its left child are red, the grandchild becomes the root
+            NodePtr p = std::move(gn->_rgt);
+            Node *pn = p.mut();
+            NodePtr c = std::move(pn->_lft);
+            Node *cn = c.mut();
+            gn->_rgt = std::move(cn->_lft);
+            update(gn);
+            pn->_lft = std::move(cn->_rgt);
+            pn->_c = Color::B;
+            update(pn);
+            cn->_lft = std::move(g);
+            cn->_rgt = std::move(p);
+            cn->_c = Color::R;
+            update(cn);
+            return c;
+        } else if (gn->_c == Color::B && doubledRight(gn->_rgt)) {
+            // Case 4: right child and its right child are red, rotate left
+            NodePtr p = std::move(gn->_rgt);
+            Node *pn = p.mut();
+            paint(pn->_rgt, Color::B);
+            gn->_rgt = std::move(pn->_lft);
+            update(gn);
+            pn->_lft = std::move(g);
+            pn->_c = Color::R;
+            update(pn);
+            return p;
+        }
+        return g; // Default Case: no balancing is needed
     }
 };
 
+template<typename T, typename Alloc, typename RefCount>
+typename RBTree<T, Alloc, RefCount>::Transient RBTree<T, Alloc, RefCount>::transient() const {
+    return Transient(*this);
+}
+
 #endif // RED_BLACK_TREE_H
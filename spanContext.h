@@ -0,0 +1,35 @@
+#ifndef SPAN_CONTEXT_H
+#define SPAN_CONTEXT_H
+
+class ScopedSpan;
+
+// Innermost open span of each thread, which the spans it opens next nest in (see ScopedSpan)
+// Kept apart from the metrics registry so that the thread pool can carry it into the tasks it runs
+// without depending on metrics.h: a forked task nests its spans in the span open where it was forked.
+class SpanContext {
+public:
+    // Innermost open span of the calling thread, if any
+    static ScopedSpan *current() { return _current; }
+
+    // Makes the spans opened on the calling thread during its lifetime nest in the given span of
+    // another thread (or in none), as for a task run on behalf of that thread; the span must stay
+    // open meanwhile
+    class Nesting {
+    public:
+        explicit Nesting(ScopedSpan *parent) : _previous(_current) { _current = parent; }
+        ~Nesting() { _current = _previous; }
+
+        Nesting(Nesting const &) = delete;
+        Nesting &operator=(Nesting const &) = delete;
+
+    private:
+        ScopedSpan *_previous;
+    };
+
+private:
+    friend class ScopedSpan;
+
+    static inline thread_local ScopedSpan *_current = nullptr;
+};
+
+#endif // SPAN_CONTEXT_H
@@ -1,9 +1,14 @@
 #include "doctest.h"
 #include "header.h"
+#include "benchHarness.h"
+#include <algorithm>
 #include <filesystem>
 #include <cctype>
 #include <random>
 #include <fstream>
+#include <sstream>
+#include <functional>
+#include <ctime>
 
 // Helper function to generate a valid file with specific content
 // This is used to create a temporary file for testing purposes
@@ -49,8 +54,9 @@ std::string generateRandomStringWithApostrophes(size_t coreLength) {
     std::uniform_int_distribution<> dist(0, characters.size() - 1);
 
     // Generate the main core of the random string
+    std::vector<size_t> positions(coreLength);
     std::string core = std::accumulate(
-        std::vector<size_t>(coreLength).begin(), std::vector<size_t>(coreLength).end(),
+        positions.begin(), positions.end(),
         std::string(),
         [&](std::string acc, size_t) {
             return acc + characters[dist(gen)];
@@ -115,8 +121,9 @@ std::string generateRandomText(size_t length) {
     std::uniform_int_distribution<> dist(0, characters.size() - 1);
 
     // Generate a random string of specified length
+    std::vector<size_t> positions(length);
     return std::accumulate(
-        std::vector<size_t>(length).begin(), std::vector<size_t>(length).end(),
+        positions.begin(), positions.end(),
         std::string(),
         [&](std::string acc, size_t) {
             return acc + characters[dist(gen)];
@@ -152,14 +159,102 @@ std::string generateComplexRandomText(size_t length) {
     std::mt19937 gen(rd());
     std::uniform_int_distribution<> dist(0, characters.size() - 1);
 
+    std::vector<size_t> positions(length);
     return std::accumulate(
-        std::vector<size_t>(length).begin(), std::vector<size_t>(length).end(),
+        positions.begin(), positions.end(),
         std::string(),
         [&](std::string acc, size_t) {
             return acc + characters[dist(gen)];
         });
 }
 
+// Reference tokenizer: the original lowercase / split / trim pipeline, kept as the specification
+std::vector<std::string> referenceTokenize(const std::string& text) {
+    std::string processed;
+    for (unsigned char c : text) processed.push_back((std::isalpha(c) || c == '\'') ? std::tolower(c) : ' ');
+    std::istringstream iss(processed);
+    std::vector<std::string> tokens;
+    for (std::string word; iss >> word;) {
+        auto cleaned = trimApostrophes(word);
+        if (!cleaned.empty()) tokens.push_back(cleaned);
+    }
+    return tokens;
+}
+
+// Generate random text over all 256 byte values, weighted towards letters, apostrophes and spaces
+std::string generateRandomBytes(size_t length) {
+    std::mt19937 gen(std::random_device{}());
+    std::uniform_int_distribution<> dist(0, 511);
+    std::string text(length, '\0');
+    for (auto& c : text) {
+        int r = dist(gen);
+        c = static_cast<char>(r < 256 ? r : r < 448 ? "aZ' "[r % 4] : 'a' + r % 26);
+    }
+    return text;
+}
+
+// Test cases for the zero-copy `tokenizeViews` function
+TEST_CASE("tokenizeViews Function") {
+    // Same words as the reference pipeline, on random and on adversarial input
+    SUBCASE("Matches Reference") {
+        for (int i = 0; i < 20; ++i) {
+            auto text = i % 2 ? generateComplexRandomText(500) : generateRandomBytes(2000);
+            auto views = tokenizeViews(text);
+            CHECK(std::vector<std::string>(views.words.begin(), views.words.end()) == referenceTokenize(text));
+            CHECK(tokenize(text) == referenceTokenize(text));
+        }
+    }
+
+    // Apostrophes, digits, case and non-ASCII bytes
+    SUBCASE("Edge Cases") {
+        std::vector<std::string> cases = {
+            "", "'", "'''", "a", "'Tis", "rock'n'roll", "don't''", "A1B2", "x''y", "caf\xc3\xa9 NA\xefVE",
+            "end.", "  leading and trailing  ", "'' 'a' ''b'' c'"
+        };
+        for (const auto& text : cases) {
+            auto views = tokenizeViews(text);
+            CHECK(std::vector<std::string>(views.words.begin(), views.words.end()) == referenceTokenize(text));
+        }
+    }
+
+    // An empty view without data (e.g. an empty MappedFile) is scanned by every level without copying
+    SUBCASE("Null Empty Text") {
+        for (auto level : {SimdLevel::Scalar, SimdLevel::SSE2, SimdLevel::AVX2, SimdLevel::AVX512}) {
+            CHECK(tokenizeViews(std::string_view(), level).words.empty());
+        }
+    }
+
+    // Every word is a view into the buffer, which survives moving the result
+    SUBCASE("Views Into Buffer") {
+        std::string text = "One two THREE";
+        auto views = tokenizeViews(text);
+        const char* buffer = views.buffer.get();
+        auto moved = std::move(views);
+        REQUIRE(moved.words.size() == 3);
+        CHECK(moved.words[0].data() == buffer);
+        CHECK(moved.words[2].data() == buffer + 8);
+        CHECK(moved.words[2] == "three");
+    }
+    // Every SIMD level gives the same buffer and words as the scalar kernel, including
+    // words crossing 64-byte blocks and texts ending inside a block
+    SUBCASE("All SIMD Levels") {
+        for (size_t length : {0, 1, 63, 64, 65, 127, 128, 200, 5000}) {
+            auto text = generateRandomBytes(length);
+            text += std::string(length % 3, 'Q');  // Sometimes end inside a word
+            auto scalar = tokenizeViews(text, SimdLevel::Scalar);
+            for (auto level : {SimdLevel::SSE2, SimdLevel::AVX2, SimdLevel::AVX512}) {
+                CAPTURE(simdLevelName(level));
+                auto vectorized = tokenizeViews(text, level);
+                CHECK(std::equal(scalar.buffer.get(), scalar.buffer.get() + text.size(), vectorized.buffer.get()));
+                CHECK(std::vector<std::string>(vectorized.words.begin(), vectorized.words.end())
+                      == std::vector<std::string>(scalar.words.begin(), scalar.words.end()));
+            }
+        }
+        std::string longWord(300, 'W');  // A word spanning several blocks
+        CHECK(tokenizeViews("'" + longWord + "'").words == std::vector<std::string_view>{std::string(300, 'w')});
+    }
+}
+
 // Generate structured text for testing parallelTokenize
 std::string generateKnownStructuredText() {
     return "Parallel tokenization should match single-threaded tokenization exactly.";
@@ -214,6 +309,25 @@ TEST_CASE("parallelTokenize Function") {
         CHECK(parallelTokens == sequentialTokens);                // Verify tokenization results
     };
 
+    // Test N-way chunking: tiny chunks put boundaries next to digits, apostrophes and words
+    auto testChunking = []() {
+        for (size_t chunkBytes : {1, 3, 7, 64, 1000}) {
+            for (unsigned workers : {1u, 2u, 5u}) {
+                auto text = generateRandomBytes(3000) + generateComplexRandomText(500) + "Rock'n'roll 1x'y'2";
+                auto parallelTokens = parallelTokenizeViews(text, workers, chunkBytes);
+                auto sequentialTokens = tokenizeViews(text);
+                CHECK(parallelTokens.words.size() == sequentialTokens.words.size());
+                CHECK(std::equal(parallelTokens.words.begin(), parallelTokens.words.end(),
+                                 sequentialTokens.words.begin(), sequentialTokens.words.end()));
+                CHECK(std::all_of(parallelTokens.words.begin(), parallelTokens.words.end(), [&](std::string_view word) {
+                    return word.data() >= parallelTokens.buffer.get() &&
+                           word.data() + word.size() <= parallelTokens.buffer.get() + text.size();
+                }));
+            }
+        }
+        CHECK(parallelTokenizeViews("", 4, 1).words.empty());
+    };
+
     // Execute all test cases
     testStructuredText();
     for (int i = 0; i < 5; ++i) {  // Repeat random tests for better coverage
@@ -221,6 +335,7 @@ TEST_CASE("parallelTokenize Function") {
     }
     testEdgeCases();
     testLargeInput();
+    testChunking();
 }
 
 // Helper function to generate random integers for RBTree testing
@@ -290,4 +405,1221 @@ TEST_CASE("RBTree") {
         auto sortedValues = tree.getSortedValues();
         CHECK(sortedValues == std::vector<int>{42});  // Ensure the tree contains only the inserted value
     }
-}
\ No newline at end of file
+}
+
+// Test cases for the arena-backed `RBTree`
+TEST_CASE("RBTree with ArenaAllocator") {
+    // Arena-backed trees must hold exactly the same values as heap-backed trees
+    SUBCASE("Matches Default Allocator") {
+        auto randomValues = generateRandomIntegers(1000);  // Generate random integers
+
+        RBTree<int> heapTree;
+        RBTree<int, ArenaAllocator<int>> arenaTree;
+        for (const auto& value : randomValues) {
+            heapTree = heapTree.insert(value);
+            arenaTree = arenaTree.insert(value);
+        }
+        CHECK(arenaTree.getSortedValues() == heapTree.getSortedValues());
+    }
+
+    // Nodes of one lineage are carved out of a few contiguous chunks
+    SUBCASE("Nodes Share One Arena") {
+        ArenaAllocator<int> alloc;
+        RBTree<int, ArenaAllocator<int>> tree{alloc};
+        for (int i = 0; i < 1000; ++i) {
+            tree = tree.insert(i);
+        }
+        CHECK(tree.getAllocator() == alloc);  // Every version keeps using the same arena
+        CHECK(alloc.arena().chunkCount() >= 1);
+        CHECK(alloc.arena().chunkCount() < 10);  // Freed path copies are recycled instead of growing the arena
+    }
+
+    // Older versions stay valid and the arena outlives its creator
+    SUBCASE("Arena Outlives Allocator Owner") {
+        RBTree<int, ArenaAllocator<int>> older;
+        {
+            RBTree<int, ArenaAllocator<int>> tree;
+            for (int i = 0; i < 100; ++i) {
+                tree = tree.insert(i);
+            }
+            older = tree;
+            tree = tree.insert(1000);
+            CHECK(tree.getSortedValues().size() == 101);
+        }
+        CHECK(older.getSortedValues().size() == 100);  // Nodes are still alive through `older`
+    }
+
+    // The arena is only created when first used, and copies made before that share it
+    SUBCASE("Arena Created On First Use") {
+        ArenaAllocator<int> alloc;
+        ArenaAllocator<int> copy(alloc);
+        CHECK(&copy.arena() == &alloc.arena());
+        CHECK(alloc.arena().chunkCount() == 0);
+
+        RBTree<int, ArenaAllocator<int>> tree;
+        for (int i = 0; i < 100; ++i) {
+            tree = tree.insert(i);
+        }
+        CHECK(tree.getAllocator().arena().chunkCount() == 1);  // All versions share one arena
+    }
+}
+
+// Test cases for the non-atomic reference counting policy
+TEST_CASE("RBTree with LocalRefCount") {
+    // Both reference counting policies must build identical trees
+    SUBCASE("Matches AtomicRefCount") {
+        auto randomValues = generateRandomIntegers(1000);  // Generate random integers
+
+        RBTree<int> atomicTree;
+        RBTree<int, std::allocator<int>, LocalRefCount> localTree;
+        for (const auto& value : randomValues) {
+            atomicTree = atomicTree.insert(value);
+            localTree = localTree.insert(value);
+        }
+        CHECK(localTree.getSortedValues() == atomicTree.getSortedValues());
+    }
+
+    // Older versions keep their nodes while newer versions are created and destroyed
+    SUBCASE("Persistence of Older Versions") {
+        RBTree<int, std::allocator<int>, LocalRefCount> tree;
+        std::vector<RBTree<int, std::allocator<int>, LocalRefCount>> versions;
+        for (int i = 0; i < 50; ++i) {
+            versions.push_back(tree);
+            tree = tree.insert(i);
+        }
+        tree = RBTree<int, std::allocator<int>, LocalRefCount>();  // Drop the newest version
+        for (size_t i = 0; i < versions.size(); ++i) {
+            CHECK(versions[i].getSortedValues().size() == i);  // Version i holds exactly i values
+        }
+    }
+
+    // Trees built on pool workers are handed over whole when the forked tasks join
+    SUBCASE("Parallel Insert") {
+        auto randomValues = generateRandomIntegers(1000);
+        auto tree = parallelInsert<int, ArenaAllocator<int>, LocalRefCount>(randomValues);
+
+        auto expectedValues = randomValues;
+        std::sort(expectedValues.begin(), expectedValues.end());
+        expectedValues.erase(std::unique(expectedValues.begin(), expectedValues.end()), expectedValues.end());
+        CHECK(tree.getSortedValues() == expectedValues);
+    }
+}
+
+// Test cases for duplicate-aware insertion
+TEST_CASE("RBTree Duplicate Insert") {
+    RBTree<int> tree;
+    for (int i = 0; i < 100; ++i) {
+        tree = tree.insert(i * 2);  // Insert even numbers only
+    }
+
+    // Inserting an existing value returns the very same version without allocating
+    SUBCASE("Existing Value") {
+        auto before = RBTree<int>::allocationCount();
+        auto same = tree.insert(42);
+        CHECK(RBTree<int>::allocationCount() == before);  // No node allocated
+        CHECK(same.isIdentical(tree));  // Same root node
+    }
+
+    // Inserting a new value copies only one root-to-leaf path
+    SUBCASE("New Value") {
+        auto before = RBTree<int>::allocationCount();
+        auto bigger = tree.insert(43);
+        auto allocated = RBTree<int>::allocationCount() - before;
+        CHECK(!bigger.isIdentical(tree));
+        CHECK(allocated > 0);
+        CHECK(allocated <= 3 * 15);  // At most three nodes per level of the path (height <= 2 * log2(101) + 1)
+        CHECK(bigger.getSortedValues().size() == 101);
+        CHECK(tree.getSortedValues().size() == 100);  // The original version is unchanged
+    }
+}
+
+// Helper function to validate the red-black invariants of a tree
+// Returns the black height of the tree, or -1 if a red node has a red child or two paths differ
+template <typename Tree>
+int blackHeight(const Tree& tree) {
+    if (tree.isEmpty()) return 0;
+    auto redChild = [](const Tree& child) { return !child.isEmpty() && child.rootColor() == Color::R; };
+    if (tree.rootColor() == Color::R && (redChild(tree.left()) || redChild(tree.right()))) return -1;
+    int left = blackHeight(tree.left());
+    int right = blackHeight(tree.right());
+    if (left < 0 || left != right) return -1;
+    return left + (tree.rootColor() == Color::B ? 1 : 0);
+}
+
+// Test cases for bulk construction from sorted data
+TEST_CASE("RBTree fromSorted") {
+    // Every size up to a few hundred yields a valid tree with exactly n allocations
+    SUBCASE("Valid Trees of Every Size") {
+        for (int n = 0; n < 300; ++n) {
+            std::vector<int> values(n);
+            std::iota(values.begin(), values.end(), 0);  // 0, 1, ..., n - 1
+
+            auto before = RBTree<int>::allocationCount();
+            auto tree = RBTree<int>::fromSorted(values.begin(), values.end());
+            CHECK(RBTree<int>::allocationCount() - before == static_cast<size_t>(n));  // One node per value
+            CHECK(tree.getSortedValues() == values);
+            CHECK(blackHeight(tree) >= 0);  // Red-black invariants hold
+            CHECK((tree.isEmpty() || tree.rootColor() == Color::B));
+        }
+    }
+
+    // The bulk-built tree behaves like any other tree afterwards
+    SUBCASE("Insert After Bulk Construction") {
+        std::vector<std::string> words = {"apple", "banana", "cherry", "date", "elderberry"};
+        auto tree = RBTree<std::string>::fromSorted(words.begin(), words.end());
+        tree = tree.insert("blueberry");
+        CHECK(tree.getSortedValues() == std::vector<std::string>{"apple", "banana", "blueberry", "cherry", "date", "elderberry"});
+        CHECK(blackHeight(tree) >= 0);
+    }
+
+    // The parallel build produces the same tree as the sequential one
+    SUBCASE("Parallel Variant") {
+        auto values = generateRandomIntegers(5000, 0, 100000);
+        std::sort(values.begin(), values.end());
+        values.erase(std::unique(values.begin(), values.end()), values.end());
+
+        auto tree = RBTree<int>::fromSortedParallel(values.begin(), values.end(), {}, 256);
+        CHECK(tree.getSortedValues() == values);
+        CHECK(blackHeight(tree) == blackHeight(RBTree<int>::fromSorted(values.begin(), values.end())));
+
+        auto arenaTree = RBTree<int, ArenaAllocator<int>>::fromSortedParallel(values.begin(), values.end());
+        CHECK(arenaTree.getSortedValues() == values);  // Falls back to the sequential build
+    }
+}
+
+// Helper function to build a tree from a vector of values
+template <typename Tree, typename T>
+Tree buildTree(const std::vector<T>& values) {
+    return std::accumulate(values.begin(), values.end(), Tree(), [](const Tree& tree, const T& value) {
+        return tree.insert(value);
+    });
+}
+
+// Helper function to sort and deduplicate a vector of values
+template <typename T>
+std::vector<T> sortedUnique(std::vector<T> values) {
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+    return values;
+}
+
+// Test cases for join, split and union
+TEST_CASE("RBTree join, split and unionWith") {
+    // Joining trees of very different sizes keeps the tree valid
+    SUBCASE("Join") {
+        for (int small = 0; small < 40; small += 3) {
+            std::vector<int> lower(small), upper(500);
+            std::iota(lower.begin(), lower.end(), 0);
+            std::iota(upper.begin(), upper.end(), 1000);
+
+            auto lowerTree = buildTree<RBTree<int>>(lower);
+            auto upperTree = buildTree<RBTree<int>>(upper);
+            auto joined = RBTree<int>::join(lowerTree, 500, upperTree);
+            std::vector<int> top(small);
+            std::iota(top.begin(), top.end(), 3000);
+            auto mirrored = RBTree<int>::join(upperTree, 2000, buildTree<RBTree<int>>(top));  // Taller left tree
+
+            auto expected = lower;
+            expected.push_back(500);
+            expected.insert(expected.end(), upper.begin(), upper.end());
+            CHECK(joined.getSortedValues() == expected);
+            CHECK(blackHeight(joined) >= 0);
+            CHECK(mirrored.getSortedValues().size() == upper.size() + 1 + top.size());
+            CHECK(blackHeight(mirrored) >= 0);
+        }
+    }
+
+    // Splitting yields the values below and above the pivot
+    SUBCASE("Split") {
+        auto values = generateRandomIntegers(500);
+        auto tree = buildTree<RBTree<int>>(values);
+        auto expected = sortedUnique(values);
+
+        for (int pivot : {-1, 0, 250, 500, 1001}) {
+            auto [lower, found, upper] = tree.split(pivot);
+            auto lowerValues = lower.getSortedValues();
+            auto upperValues = upper.getSortedValues();
+            CHECK(found == std::binary_search(expected.begin(), expected.end(), pivot));
+            CHECK(std::all_of(lowerValues.begin(), lowerValues.end(), [&](int v) { return v < pivot; }));
+            CHECK(std::all_of(upperValues.begin(), upperValues.end(), [&](int v) { return v > pivot; }));
+            CHECK(lowerValues.size() + upperValues.size() + (found ? 1 : 0) == expected.size());
+            CHECK(blackHeight(lower) >= 0);
+            CHECK(blackHeight(upper) >= 0);
+        }
+    }
+
+    // Union contains every value of both trees
+    SUBCASE("Union of Random Trees") {
+        auto values1 = generateRandomIntegers(700);
+        auto values2 = generateRandomIntegers(300);
+        auto merged = mergeTrees(buildTree<RBTree<int>>(values1), buildTree<RBTree<int>>(values2));
+
+        auto expected = values1;
+        expected.insert(expected.end(), values2.begin(), values2.end());
+        CHECK(merged.getSortedValues() == sortedUnique(expected));
+        CHECK(blackHeight(merged) >= 0);
+    }
+
+    // Union of two versions of the same lineage reuses the shared structure
+    SUBCASE("Union Reuses Shared Subtrees") {
+        auto tree = buildTree<RBTree<int>>(generateRandomIntegers(1000, 0, 100000));
+        auto before = RBTree<int>::allocationCount();
+        CHECK(tree.unionWith(tree).isIdentical(tree));  // Nothing to do
+        CHECK(tree.unionWith(RBTree<int>()).isIdentical(tree));
+        CHECK(RBTree<int>::allocationCount() == before);  // No node allocated
+    }
+}
+
+// Test cases for the parallel set operations
+TEST_CASE("RBTree Set Operations") {
+    auto values1 = generateRandomIntegers(3000, 0, 5000);
+    auto values2 = generateRandomIntegers(2000, 0, 5000);
+    auto tree1 = buildTree<RBTree<int>>(values1);
+    auto tree2 = buildTree<RBTree<int>>(values2);
+    auto sorted1 = sortedUnique(values1);
+    auto sorted2 = sortedUnique(values2);
+
+    // Compare every operation against the std:: algorithms on sorted vectors,
+    // both sequentially (grain size 0) and with forking on small subtrees
+    for (std::size_t grainSize : {std::size_t{0}, std::size_t{16}}) {
+        std::vector<int> expectedUnion, expectedIntersection, expectedDifference;
+        std::set_union(sorted1.begin(), sorted1.end(), sorted2.begin(), sorted2.end(), std::back_inserter(expectedUnion));
+        std::set_intersection(sorted1.begin(), sorted1.end(), sorted2.begin(), sorted2.end(), std::back_inserter(expectedIntersection));
+        std::set_difference(sorted1.begin(), sorted1.end(), sorted2.begin(), sorted2.end(), std::back_inserter(expectedDifference));
+
+        auto unionTree = tree1.unionWith(tree2, grainSize);
+        auto intersectionTree = tree1.intersect(tree2, grainSize);
+        auto differenceTree = tree1.difference(tree2, grainSize);
+        CHECK(unionTree.getSortedValues() == expectedUnion);
+        CHECK(intersectionTree.getSortedValues() == expectedIntersection);
+        CHECK(differenceTree.getSortedValues() == expectedDifference);
+        CHECK(blackHeight(unionTree) >= 0);
+        CHECK(blackHeight(intersectionTree) >= 0);
+        CHECK(blackHeight(differenceTree) >= 0);
+    }
+
+    // Results share structure with their inputs
+    SUBCASE("Structure Sharing") {
+        auto newer = tree1.insert(-1);  // A version sharing most subtrees with tree1
+        CHECK(tree1.intersect(tree1).isIdentical(tree1));
+        CHECK(tree1.difference(tree1).isEmpty());
+        CHECK(newer.difference(tree1).getSortedValues() == std::vector<int>{-1});
+        CHECK(newer.intersect(tree1).getSortedValues() == sorted1);
+    }
+
+    // Trees with non-atomic reference counts run the same operations sequentially
+    SUBCASE("Local Reference Counts") {
+        using LocalTree = RBTree<int, ArenaAllocator<int>, LocalRefCount>;
+        auto local1 = buildTree<LocalTree>(values1);
+        auto local2 = buildTree<LocalTree>(values2);
+        CHECK(local1.unionWith(local2, 16).getSortedValues() == tree1.unionWith(tree2).getSortedValues());
+        CHECK(local1.difference(local2, 16).getSortedValues() == tree1.difference(tree2).getSortedValues());
+    }
+}
+
+// Test cases for the N-way `parallelInsert`
+TEST_CASE("parallelInsert Function") {
+    auto values = generateRandomIntegers(2000);
+    auto expected = sortedUnique(values);
+
+    // Any number of workers gives the same set of values and a valid tree
+    for (unsigned workers : {0u, 1u, 2u, 3u, 4u, 7u, 8u, 64u}) {
+        auto tree = parallelInsert(values, workers);
+        CHECK(tree.getSortedValues() == expected);
+        CHECK(blackHeight(tree) >= 0);
+
+        auto wordTree = parallelInsert<int, ArenaAllocator<int>, LocalRefCount>(values, workers);
+        CHECK(wordTree.getSortedValues() == expected);
+    }
+
+    // More workers than values
+    CHECK(parallelInsert(std::vector<int>{3, 1, 2}, 16).getSortedValues() == std::vector<int>{1, 2, 3});
+    CHECK(parallelInsert(std::vector<int>{}, 4).isEmpty());
+}
+
+// Test cases for the range-partitioned `rangePartitionedInsert`
+TEST_CASE("rangePartitionedInsert Function") {
+    // Random input with many duplicates, for several worker counts
+    auto values = generateRandomIntegers(3000);
+    auto expected = sortedUnique(values);
+    for (unsigned workers : {1u, 2u, 3u, 8u, 33u}) {
+        auto tree = rangePartitionedInsert(values, workers);
+        CHECK(tree.getSortedValues() == expected);
+        CHECK(blackHeight(tree) >= 0);
+
+        auto wordTree = rangePartitionedInsert<int, ArenaAllocator<int>, LocalRefCount>(values, workers);
+        CHECK(wordTree.getSortedValues() == expected);
+    }
+
+    // Fewer distinct values than workers: some ranges collapse
+    std::vector<int> fewDistinct(500, 7);
+    fewDistinct.push_back(3);
+    CHECK(rangePartitionedInsert(fewDistinct, 16).getSortedValues() == std::vector<int>{3, 7});
+
+    // Strings, as used by processFileWithTiming
+    auto words = tokenize(generateComplexRandomText(2000));
+    CHECK(rangePartitionedInsert(words, 4).getSortedValues() == sortedUnique(words));
+    CHECK(rangePartitionedInsert(std::vector<std::string>{}, 4).isEmpty());
+}
+
+// Test cases for the transient builder
+TEST_CASE("RBTree Transient") {
+    // A fresh builder allocates exactly one node per distinct value: no path copying
+    SUBCASE("Fresh Builder") {
+        auto values = generateRandomIntegers(2000);
+        auto before = RBTree<int>::allocationCount();
+        RBTree<int>::Transient builder;
+        for (const auto& value : values) {
+            builder.insert(value);
+        }
+        auto tree = builder.persistent();
+        CHECK(RBTree<int>::allocationCount() - before == sortedUnique(values).size());
+        CHECK(tree.getSortedValues() == sortedUnique(values));
+        CHECK(blackHeight(tree) >= 0);
+    }
+
+    // Versions shared with other trees are never modified
+    SUBCASE("Persistence of Shared Versions") {
+        auto original = buildTree<RBTree<int, ArenaAllocator<int>, LocalRefCount>>(generateRandomIntegers(500, 0, 10000));
+        auto originalValues = original.getSortedValues();
+
+        auto builder = original.transient();
+        for (int i = -100; i < 0; ++i) {
+            builder.insert(i);
+        }
+        auto frozen = builder.persistent();
+        for (int i = 20000; i < 20100; ++i) {
+            builder.insert(i);  // Keeps working after persistent()
+        }
+        auto later = builder.persistent();
+
+        CHECK(original.getSortedValues() == originalValues);  // Untouched by the builder
+        CHECK(frozen.getSortedValues().size() == originalValues.size() + 100);  // Untouched by later inserts
+        CHECK(later.getSortedValues().size() == originalValues.size() + 200);
+        CHECK(blackHeight(frozen) >= 0);
+        CHECK(blackHeight(later) >= 0);
+    }
+
+    // Duplicates neither allocate nor change the root
+    SUBCASE("Duplicates") {
+        RBTree<int>::Transient builder;
+        for (int i = 0; i < 100; ++i) {
+            builder.insert(i);
+        }
+        auto tree = builder.persistent();
+        auto before = RBTree<int>::allocationCount();
+        builder.insert(50);
+        CHECK(RBTree<int>::allocationCount() == before);
+        CHECK(builder.persistent().isIdentical(tree));
+    }
+}
+
+// Test cases for the in-order iterator
+TEST_CASE("RBTree Iterator") {
+    // Iteration visits the same values as getSortedValues
+    SUBCASE("Matches getSortedValues") {
+        auto tree = buildTree<RBTree<int>>(generateRandomIntegers(2000));
+        std::vector<int> iterated(tree.begin(), tree.end());
+        CHECK(iterated == tree.getSortedValues());
+        CHECK(static_cast<size_t>(std::distance(tree.begin(), tree.end())) == iterated.size());
+    }
+
+    // Empty trees and single elements
+    SUBCASE("Edge Cases") {
+        RBTree<int> empty;
+        CHECK(empty.begin() == empty.end());
+        auto single = empty.insert(42);
+        auto it = single.begin();
+        CHECK(*it == 42);
+        CHECK(++it == single.end());
+    }
+
+    // Values are yielded by reference into the tree's nodes
+    SUBCASE("No Copies") {
+        auto tree = buildTree<RBTree<std::string>>(std::vector<std::string>{"b", "a", "c"});
+        const std::string& first = *tree.begin();
+        CHECK(&first == &*tree.begin());
+        CHECK(std::string(tree.begin()->c_str()) == "a");
+    }
+
+    // Writing straight from the tree produces one sorted word per line
+    SUBCASE("writeToFile From Tree") {
+        auto tree = buildTree<WordTree>(std::vector<std::string>{"pear", "apple", "fig", "apple"});
+        auto filePath = generateValidFile("");
+        writeToFile(filePath, tree);
+        CHECK(readFile(filePath) == "apple\nfig\npear\n");
+        std::filesystem::remove(filePath);
+    }
+}
+
+// Key type counting its copies, to check that insert moves the value into its node
+struct CountedKey {
+    int value;
+    static inline int copies = 0;
+    explicit CountedKey(int v) : value(v) {}
+    CountedKey(const CountedKey& other) : value(other.value) { ++copies; }
+    CountedKey(CountedKey&& other) noexcept = default;
+    bool operator<(const CountedKey& other) const { return value < other.value; }
+};
+
+// Test cases for lookups and inserts with keys of another type than the stored values
+TEST_CASE("RBTree Heterogeneous Lookup and Insert") {
+    auto tree = buildTree<WordTree>(std::vector<std::string>{"pear", "apple", "fig", "kiwi"});
+
+    // Lookups with string_view compare directly against the stored strings
+    SUBCASE("contains and find") {
+        std::string_view buffer = "fig plum apple";
+        CHECK(tree.contains(buffer.substr(0, 3)));
+        CHECK(!tree.contains(buffer.substr(4, 4)));
+        CHECK(tree.contains(std::string("kiwi")));
+        const std::string* found = tree.find(buffer.substr(9));
+        REQUIRE(found != nullptr);
+        CHECK(*found == "apple");
+        CHECK(found == &*tree.begin());  // Points into the tree's node
+        CHECK(tree.find(std::string_view("zebra")) == nullptr);
+        CHECK(!WordTree().contains(std::string_view("fig")));
+    }
+
+    // A string is only constructed when the view's key is new
+    SUBCASE("Insert From string_view") {
+        auto before = WordTree::allocationCount();
+        auto same = tree.insert(std::string_view("kiwi"));
+        CHECK(WordTree::allocationCount() == before);
+        CHECK(same.isIdentical(tree));
+        auto bigger = tree.insert(std::string_view("banana"));
+        CHECK(bigger.getSortedValues() == std::vector<std::string>{"apple", "banana", "fig", "kiwi", "pear"});
+        CHECK(blackHeight(bigger) > 0);
+    }
+
+    // An rvalue key is moved into the new node, an lvalue key is copied exactly once
+    SUBCASE("Move Into Node") {
+        CountedKey::copies = 0;
+        auto moved = RBTree<CountedKey>().insert(CountedKey(1));
+        CHECK(CountedKey::copies == 0);
+        CountedKey key(2);
+        auto copied = moved.insert(key);
+        CHECK(CountedKey::copies >= 1);
+
+        // A fresh transient relinks nodes in place, so moved keys are never copied
+        CountedKey::copies = 0;
+        RBTree<CountedKey>::Transient builder;
+        for (int i : generateRandomIntegers(500)) builder.insert(CountedKey(i));
+        CHECK(CountedKey::copies == 0);
+        CHECK(blackHeight(builder.persistent()) > 0);
+    }
+}
+
+// Test cases for the memory-mapped input `MappedFile`
+TEST_CASE("MappedFile") {
+    // The view holds the same bytes as readFile, with and without prefaulting
+    SUBCASE("Matches readFile") {
+        std::string content(100000, '\0');
+        for (size_t i = 0; i < content.size(); ++i) content[i] = static_cast<char>(i * 31 % 251);
+        auto filePath = generateValidFile(content);
+        for (bool populate : {false, true}) {
+            MappedFile mapped(filePath, populate);
+            CHECK(mapped.size() == content.size());
+            CHECK(mapped.view() == readFile(filePath));
+        }
+        std::filesystem::remove(filePath);
+    }
+
+    // Empty files give an empty view, missing files throw like readFile
+    SUBCASE("Edge Cases") {
+        auto filePath = generateValidFile("");
+        MappedFile empty(filePath);
+        CHECK(empty.view().empty());
+        CHECK(!empty.isMapped());
+        std::filesystem::remove(filePath);
+        CHECK_THROWS_AS(MappedFile{generateInvalidFilePath()}, std::runtime_error);
+    }
+
+    // Moving keeps the view valid, and the mapped text tokenizes like the buffered one
+    SUBCASE("Move And Tokenize") {
+        std::string content = generateComplexRandomText(3000);
+        auto filePath = generateValidFile(content);
+        MappedFile mapped(filePath);
+        const char* data = mapped.view().data();
+        MappedFile moved(std::move(mapped));
+        CHECK(moved.view().data() == data);
+        CHECK(mapped.view().empty());
+        auto tokens = tokenizeViews(moved.view());
+        CHECK(std::vector<std::string>(tokens.words.begin(), tokens.words.end()) == tokenize(content));
+        moved = MappedFile();  // Unmapping does not affect the tokens, which live in their own buffer
+        CHECK(std::vector<std::string>(tokens.words.begin(), tokens.words.end()) == tokenize(content));
+        std::filesystem::remove(filePath);
+    }
+
+    // The pipeline writes the same output from a mapped input
+    SUBCASE("processFileWithTiming") {
+        auto inputPath = generateValidFile(generateComplexRandomText(5000));
+        auto bufferedPath = generateValidFile("");
+        auto mappedPath = generateValidFile("");
+        processFileWithTiming(inputPath, bufferedPath, false);
+        processFileWithTiming(inputPath, mappedPath, ProcessingOptions{.useParallel = true, .mapInput = true, .populate = true});
+        CHECK(readFile(mappedPath) == readFile(bufferedPath));
+        CHECK(!readFile(mappedPath).empty());
+        for (const auto& path : {inputPath, bufferedPath, mappedPath}) std::filesystem::remove(path);
+    }
+}
+
+// Test cases for the chunked `buildTreeStreaming`
+TEST_CASE("buildTreeStreaming Function") {
+    // Any chunk size gives the words of the whole text, also when chunks cut words and apostrophes
+    SUBCASE("Matches tokenize") {
+        std::string content = generateRandomBytes(4000) + generateComplexRandomText(2000) + " tail'word";
+        auto filePath = generateValidFile(content);
+        auto expected = sortedUnique(tokenize(content));
+        for (size_t chunkBytes : {1, 2, 5, 64, 1000, 100000}) {
+            CAPTURE(chunkBytes);
+            StreamingStats stats;
+            auto tree = buildTreeStreaming(filePath, chunkBytes, stats);
+            CHECK(tree.getSortedValues() == expected);
+            CHECK(stats.bytesRead == content.size());
+            CHECK(stats.words == tokenize(content).size());
+            CHECK(blackHeight(tree) >= 0);
+        }
+        std::filesystem::remove(filePath);
+    }
+
+    // Memory stays bounded by the chunk and the vocabulary, even for a long repetitive input
+    SUBCASE("Bounded Memory") {
+        std::string content;
+        for (int i = 0; i < 20000; ++i) content += "the quick brown fox jumps over the lazy dog ";
+        auto filePath = generateValidFile(content);
+        StreamingStats stats;
+        auto tree = buildTreeStreaming(filePath, 4096, stats);
+        CHECK(tree.getSortedValues().size() == 8);
+        CHECK(stats.chunks > content.size() / 4096);
+        CHECK(stats.highWaterBytes < 512 * 1024);  // One arena chunk plus the small buffers
+        std::filesystem::remove(filePath);
+    }
+
+    // The high-water mark includes the heap buffers of the long words kept in the tree
+    SUBCASE("Long Words in Memory") {
+        std::string content;
+        for (int i = 0; i < 400; ++i) {
+            std::string word(1000, 'w');
+            word[0] = static_cast<char>('a' + i % 26);  // 400 distinct words of 1000 letters
+            word[1] = static_cast<char>('a' + i / 26);
+            content += word + " ";
+        }
+        auto filePath = generateValidFile(content);
+        StreamingStats stats;
+        auto tree = buildTreeStreaming(filePath, 4096, stats);
+        CHECK(tree.getSortedValues().size() == 400);
+        CHECK(stats.highWaterBytes >= 400 * 1000 + 256 * 1024);  // Words on top of the arena chunk
+        std::filesystem::remove(filePath);
+    }
+
+    // A word longer than the chunk grows the buffer instead of being split
+    SUBCASE("Long Words") {
+        std::string longWord(10000, 'x');
+        auto filePath = generateValidFile("a " + longWord + " b");
+        StreamingStats stats;
+        auto tree = buildTreeStreaming(filePath, 16, stats);
+        CHECK(tree.getSortedValues() == std::vector<std::string>{"a", "b", longWord});
+        std::filesystem::remove(filePath);
+        CHECK_THROWS_AS(buildTreeStreaming(generateInvalidFilePath(), 16, stats), std::runtime_error);
+    }
+}
+
+// Test cases for the lock-free `BoundedQueue`
+TEST_CASE("BoundedQueue") {
+    // Items come out in order, a full queue refuses items and a closed queue drains
+    SUBCASE("Single Thread") {
+        BoundedQueue<int> queue(3);
+        CHECK(queue.capacity() == 4);  // Rounded up to a power of two
+        for (int i = 0; i < 4; ++i) CHECK(queue.tryPush(int(i)));
+        CHECK(!queue.tryPush(4));
+        int item = -1;
+        for (int i = 0; i < 4; ++i) {
+            CHECK(queue.tryPop(item));
+            CHECK(item == i);
+        }
+        CHECK(!queue.tryPop(item));
+        queue.push(7);
+        queue.close();
+        CHECK(queue.pop(item));
+        CHECK(item == 7);
+        CHECK(!queue.pop(item));
+        CHECK(queue.stats().pushes == 5);
+        CHECK(queue.stats().maxOccupancy == 4);
+    }
+
+    // Several producers and consumers: every item is delivered exactly once, in order per producer
+    SUBCASE("Many Threads") {
+        BoundedQueue<std::pair<int, int>> queue(8);
+        const int producers = 3, consumers = 3, items = 20000;
+        std::vector<std::thread> threads;
+        for (int p = 0; p < producers; ++p) {
+            threads.emplace_back([&, p]() {
+                for (int i = 0; i < items; ++i) queue.push({p, i});
+            });
+        }
+        std::vector<std::vector<std::pair<int, int>>> received(consumers);
+        std::vector<std::thread> readers;
+        for (int c = 0; c < consumers; ++c) {
+            readers.emplace_back([&, c]() {
+                for (std::pair<int, int> item; queue.pop(item);) received[c].push_back(item);
+            });
+        }
+        for (auto& thread : threads) thread.join();
+        queue.close();
+        for (auto& thread : readers) thread.join();
+
+        std::vector<int> counts(producers, 0);
+        bool ordered = true;
+        for (const auto& list : received) {
+            std::vector<int> last(producers, -1);
+            for (auto [p, i] : list) {
+                ordered = ordered && i > last[p];
+                last[p] = i;
+                ++counts[p];
+            }
+        }
+        CHECK(ordered);
+        CHECK(counts == std::vector<int>(producers, items));
+        CHECK(queue.stats().maxOccupancy <= queue.capacity());
+    }
+
+    // Closing a full queue releases the producers blocked on it
+    SUBCASE("Close While Full") {
+        BoundedQueue<int> queue(2);
+        CHECK(queue.push(1));
+        CHECK(queue.push(2));
+        bool pushed = true;
+        std::thread producer([&]() { pushed = queue.push(3); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        queue.close();
+        producer.join();
+        CHECK(!pushed);
+    }
+}
+
+// Test cases for the overlapped `buildTreePipelined`
+TEST_CASE("buildTreePipelined Function") {
+    std::string content = generateRandomBytes(6000) + generateComplexRandomText(3000) + " tail'word";
+    auto filePath = generateValidFile(content);
+    auto expected = sortedUnique(tokenize(content));
+    for (size_t chunkBytes : {1, 7, 256, 100000}) {
+        for (unsigned tokenizers : {1u, 3u}) {
+            CAPTURE(chunkBytes);
+            PipelineStats stats;
+            auto tree = buildTreePipelined(filePath, chunkBytes, tokenizers, stats);
+            CHECK(tree.getSortedValues() == expected);
+            CHECK(stats.words == tokenize(content).size());
+            CHECK(stats.chunkQueue.pushes == stats.chunks);
+            CHECK(stats.batchQueue.pushes == stats.chunks);
+            CHECK(blackHeight(tree) >= 0);
+        }
+    }
+    std::filesystem::remove(filePath);
+    PipelineStats stats;
+    CHECK_THROWS_AS(buildTreePipelined(generateInvalidFilePath(), 16, 2, stats), std::runtime_error);
+}
+
+// Test cases for the work-stealing `ThreadPool`
+TEST_CASE("ThreadPool") {
+    // Naive recursive Fibonacci, forking one call at every level
+    std::function<long(ThreadPool&, int)> fib = [&](ThreadPool& pool, int n) -> long {
+        if (n < 2) return n;
+        long a = 0, b = 0;
+        pool.parallelInvoke([&]() { a = fib(pool, n - 1); }, [&]() { b = fib(pool, n - 2); });
+        return a + b;
+    };
+
+    // Any number of workers (0 runs everything on the calling thread) gives the same results
+    for (unsigned workers : {0u, 1u, 3u}) {
+        CAPTURE(workers);
+        ThreadPool pool(workers);
+        CHECK(pool.workerCount() == workers);
+        CHECK(fib(pool, 20) == 6765);
+
+        // Nested loops: every index is visited exactly once
+        std::vector<std::atomic<int>> visits(1000);
+        pool.parallelFor(0, 10, 1, [&](size_t i) {
+            pool.parallelFor(i * 100, (i + 1) * 100, 7, [&](size_t j) { visits[j].fetch_add(1); });
+        });
+        CHECK(std::all_of(visits.begin(), visits.end(), [](const auto& v) { return v.load() == 1; }));
+        pool.parallelFor(5, 5, 1, [&](size_t) { CHECK(false); });  // Empty range
+
+        // An exception from either side reaches the caller once both sides are done
+        std::atomic<bool> otherDone{false};
+        CHECK_THROWS_AS(pool.parallelInvoke([&]() { otherDone = true; },
+                                            [&]() { throw std::runtime_error("forked"); }),
+                        std::runtime_error);
+        CHECK(otherDone);
+        CHECK_THROWS_AS(pool.parallelInvoke([&]() { throw std::runtime_error("inline"); },
+                                            [&]() { otherDone = false; }),
+                        std::runtime_error);
+        CHECK(!otherDone);
+    }
+
+    // Several threads outside the pool fork into it at the same time
+    SUBCASE("External Threads") {
+        ThreadPool pool(2);
+        std::vector<long> results(4, 0);
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < results.size(); ++t) {
+            threads.emplace_back([&, t]() { results[t] = fib(pool, 15 + static_cast<int>(t)); });
+        }
+        for (auto& thread : threads) thread.join();
+        CHECK(results == std::vector<long>{610, 987, 1597, 2584});
+    }
+
+    // A thread joining a task that runs long elsewhere sleeps instead of spinning
+    SUBCASE("Joiner Sleeps") {
+        ThreadPool pool(1);
+        std::atomic<bool> started{false};
+        std::clock_t cpuBefore = std::clock();
+        pool.parallelInvoke([&]() {
+            while (!started.load()) std::this_thread::yield();  // Leaves the task to the worker
+        }, [&]() {
+            started = true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        });
+        double cpuSeconds = static_cast<double>(std::clock() - cpuBefore) / CLOCKS_PER_SEC;
+        CHECK(cpuSeconds < 0.15);  // Spinning would take about the whole 0.3 s
+    }
+
+    // The global pool cannot be resized once running
+    SUBCASE("Global Pool") {
+        CHECK(ThreadPool::global().workerCount() >= 1);
+        CHECK(!ThreadPool::setGlobalWorkerCount(2));
+        std::atomic<size_t> sum{0};
+        parallelFor(0, 100, [&](size_t i) { sum += i; }, 4);
+        CHECK(sum == 4950);
+    }
+}
+
+// Test cases for `BufferedWriter` and the range overload of `writeToFile`
+TEST_CASE("BufferedWriter") {
+    // Whatever the buffer size, the file receives exactly the appended bytes
+    std::vector<std::string> lines = {"a", "", "medium", std::string(40, 'x'), "b'c", std::string(7, 'y')};
+    std::string expected;
+    for (const auto& line : lines) expected += line + "\n";
+    for (size_t bufferBytes : {1, 5, 8, 16, 1 << 20}) {
+        CAPTURE(bufferBytes);
+        auto filePath = generateValidFile("old content");
+        BufferedWriter writer(filePath, bufferBytes);
+        writer.append("head:");
+        for (const auto& line : lines) writer.appendLine(line);
+        CHECK(writer.bytesWritten() == expected.size() + 5);
+        writer.close();
+        writer.close();  // Closing twice is harmless
+        CHECK(readFile(filePath) == "head:" + expected);
+        if (bufferBytes == (1 << 20)) CHECK(writer.writeCalls() == 1);  // Everything fits in one write
+        std::filesystem::remove(filePath);
+    }
+
+    // The destructor flushes what is left
+    {
+        auto filePath = generateValidFile("");
+        { BufferedWriter(filePath, 64).appendLine("kept"); }
+        CHECK(readFile(filePath) == "kept\n");
+        std::filesystem::remove(filePath);
+    }
+
+    // Ranges of views, e.g. straight from a tokenizer or a tree iterator, are written as lines
+    {
+        auto filePath = generateValidFile("");
+        std::vector<std::string_view> words = {"one", "two", "three"};
+        writeToFile(filePath, words.begin(), words.end(), 4);
+        CHECK(readFile(filePath) == "one\ntwo\nthree\n");
+        std::filesystem::remove(filePath);
+    }
+
+    CHECK_THROWS_AS(BufferedWriter("/nonexistent-directory/output.txt"), std::ios_base::failure);
+    CHECK_THROWS_AS(writeToFile("/nonexistent-directory/output.txt", std::vector<std::string>{"a"}),
+                    std::ios_base::failure);
+}
+
+// Test cases for `parallelWriteToFile`
+TEST_CASE("parallelWriteToFile Function") {
+    auto words = tokenize(generateComplexRandomText(5000));
+    words.insert(words.begin() + 10, "");  // Empty lines too
+    auto expectedPath = generateValidFile("");
+    writeToFile(expectedPath, words);
+    const std::string expected = readFile(expectedPath);
+    std::filesystem::remove(expectedPath);
+
+    // Any number of workers produces exactly the sequential output, also with fewer words than pieces
+    for (unsigned workers : {1u, 2u, 3u, 8u}) {
+        CAPTURE(workers);
+        auto filePath = generateValidFile("old content that is longer than the new one");
+        parallelWriteToFile(filePath, words, workers);
+        CHECK(readFile(filePath) == expected);
+        std::vector<std::string> few(words.begin(), words.begin() + 3);
+        parallelWriteToFile(filePath, few, workers);
+        CHECK(readFile(filePath) == few[0] + "\n" + few[1] + "\n" + few[2] + "\n");
+        std::filesystem::remove(filePath);
+    }
+
+    // Straight from a tree, in sorted order
+    auto tree = buildTree<WordTree>(words);
+    auto filePath = generateValidFile("");
+    parallelWriteToFile(filePath, tree, 4);
+    std::string sorted;
+    for (const auto& word : tree.getSortedValues()) sorted += word + "\n";
+    CHECK(readFile(filePath) == sorted);
+    std::filesystem::remove(filePath);
+
+    // Nothing to write: the file is not created
+    parallelWriteToFile(filePath, std::vector<std::string>{}, 4);
+    CHECK(!std::filesystem::exists(filePath));
+
+    CHECK_THROWS_AS(parallelWriteToFile("/nonexistent-directory/output.txt", words, 4), std::ios_base::failure);
+}
+
+// Test cases for the `Metrics` registry and `ScopedSpan`
+TEST_CASE("Metrics") {
+    // Without an active registry spans and counters record nothing
+    {
+        ScopedSpan span("Unrecorded");
+        countMetric("unrecorded", 1);
+    }
+    CHECK(Metrics::active() == nullptr);
+
+    Metrics metrics("test run");
+    {
+        MetricsScope scope(metrics);
+        CHECK(Metrics::active() == &metrics);
+        {
+            ScopedSpan outer("Outer");
+            {
+                ScopedSpan inner("Inner");
+                countMetric("words", 3);
+            }
+            ScopedSpan stopped("Stopped");
+            stopped.stop();
+            stopped.stop();  // Stopping twice records once
+
+            // Spans of other threads are attributed to them, outside this thread's nesting
+            std::thread worker([]() { ScopedSpan span("Worker"); });
+            worker.join();
+        }
+        metrics.add("words", 2);
+        metrics.set("distinct", 7);
+        metrics.label("mode", "test \"quoted\"");
+    }
+    CHECK(Metrics::active() == nullptr);
+
+    auto spans = metrics.spans();
+    REQUIRE(spans.size() == 4);
+    auto find = [&](const std::string& name) {
+        return *std::find_if(spans.begin(), spans.end(), [&](const SpanRecord& s) { return s.name == name; });
+    };
+    SpanRecord outer = find("Outer"), inner = find("Inner"), worker = find("Worker");
+    CHECK(inner.path == "Outer/Inner");
+    CHECK(inner.depth == 1);
+    CHECK(find("Stopped").path == "Outer/Stopped");
+    CHECK(worker.path == "Worker");
+    CHECK(worker.thread != outer.thread);
+    CHECK(outer.startNs <= inner.startNs);
+    CHECK(inner.startNs + inner.durationNs <= outer.startNs + outer.durationNs);
+    CHECK(metrics.counters() == std::map<std::string, std::int64_t>{{"distinct", 7}, {"words", 5}});
+
+    std::ostringstream out;
+    metrics.writeJson(out);
+    const std::string json = out.str();
+    CHECK(json.find("\"run\":\"test run\"") != std::string::npos);
+    CHECK(json.find("\"mode\":\"test \\\"quoted\\\"\"") != std::string::npos);
+    CHECK(json.find("\"Outer/Inner\":{\"count\":1,") != std::string::npos);
+    CHECK(std::count(json.begin(), json.end(), '\n') == 1);  // One line per run
+
+    std::ostringstream summary;
+    metrics.printSummary(summary);
+    CHECK(summary.str().rfind("Outer took ", 0) == 0);  // Only this thread's spans, parents first
+    CHECK(summary.str().find("\n  Inner took ") != std::string::npos);
+    CHECK(summary.str().find("Worker") == std::string::npos);
+
+    // A forked task nests its spans in the span that forked it, on whichever thread runs it
+    {
+        Metrics forking;
+        MetricsScope scope(forking);
+        ThreadPool pool(1);
+        std::atomic<bool> forkedDone{false};
+        {
+            ScopedSpan span("Forking");
+            pool.parallelInvoke([&]() {
+                while (!forkedDone.load()) std::this_thread::yield();  // Leaves the task to the worker
+            }, [&]() {
+                ScopedSpan task("Task");
+                forkedDone = true;
+            });
+        }
+        auto forked = forking.spans();
+        REQUIRE(forked.size() == 2);
+        const SpanRecord& task = forked[0].name == "Task" ? forked[0] : forked[1];
+        const SpanRecord& forker = forked[0].name == "Task" ? forked[1] : forked[0];
+        CHECK(task.path == "Forking/Task");
+        CHECK(task.depth == 1);
+        CHECK(task.thread != forker.thread);
+        CHECK(SpanContext::current() == nullptr);
+    }
+
+    // Nodes built on pool workers are counted by totalAllocationCount
+    auto before = RBTree<int>::totalAllocationCount();
+    auto tree = parallelInsert<int>(std::vector<int>{5, 3, 8, 1, 9, 2, 7}, 4);
+    CHECK(RBTree<int>::totalAllocationCount() - before >= 7);
+
+    // A processed file appends one JSON line with its counters
+    auto inputPath = generateValidFile("The cat saw the other cat.");
+    auto outputPath = generateValidFile("");
+    auto metricsPath = generateValidFile("");
+    std::filesystem::remove(metricsPath);
+    for (bool parallel : {false, true}) {
+        processFileWithTiming(inputPath, outputPath,
+                              ProcessingOptions{.useParallel = parallel, .runName = "file", .metricsPath = metricsPath});
+    }
+    std::string lines = readFile(metricsPath);
+    CHECK(std::count(lines.begin(), lines.end(), '\n') == 2);
+    CHECK(lines.find("\"tokens\":6") != std::string::npos);
+    CHECK(lines.find("\"distinct_words\":4") != std::string::npos);
+    CHECK(lines.find("\"Total Processing/Tree Construction\"") != std::string::npos);
+    for (const auto& path : {inputPath, outputPath, metricsPath}) std::filesystem::remove(path);
+}
+
+// Test cases for trace spans and `Metrics::writeChromeTrace`
+TEST_CASE("Chrome Trace") {
+    auto countSpans = [](const Metrics& metrics, const std::string& name) {
+        auto spans = metrics.spans();
+        return std::count_if(spans.begin(), spans.end(), [&](const SpanRecord& s) { return s.name == name; });
+    };
+    std::string text = generateComplexRandomText(3000);
+    std::vector<int> values = generateRandomIntegers(2000);
+
+    // Without tracing only stages are recorded
+    {
+        Metrics metrics;
+        MetricsScope scope(metrics);
+        ScopedSpan stage("Stage");
+        ScopedSpan detail("Detail", SpanLevel::Trace);
+        detail.arg("ignored", 1);
+        parallelTokenizeViews(text, 3, 64);
+        detail.stop();
+        stage.stop();
+        CHECK(metrics.spans().size() == 1);
+        CHECK(metrics.spans()[0].name == "Stage");
+    }
+
+    // With tracing there is one span per chunk, per leaf of the insertion and per merge
+    Metrics metrics("traced", true);
+    {
+        MetricsScope scope(metrics);
+        CHECK(Metrics::active(SpanLevel::Trace) == &metrics);
+        auto tokens = parallelTokenizeViews(text, 3, 64);
+        auto tree = parallelInsert<int>(values, 4);
+        std::thread named([]() {
+            Metrics::nameThread("helper");
+            ScopedSpan span("Helper Work", SpanLevel::Trace);
+            span.arg("items", 42);
+        });
+        named.join();
+    }
+    CHECK(Metrics::active(SpanLevel::Trace) == nullptr);
+    CHECK(countSpans(metrics, "Tokenize Chunk") > 3);
+    CHECK(countSpans(metrics, "Tokenize Chunk") == countSpans(metrics, "Concatenate Chunk"));
+    CHECK(countSpans(metrics, "Insert Range") == 4);
+    CHECK(countSpans(metrics, "Merge Trees") == 3);
+    auto spans = metrics.spans();
+    size_t insertedWords = 0;
+    for (const auto& span : spans) {
+        CHECK(span.level == SpanLevel::Trace);
+        if (span.name == "Insert Range") insertedWords += static_cast<size_t>(span.args.at(0).second);
+    }
+    CHECK(insertedWords == values.size());  // The leaves split the input exactly
+
+    std::ostringstream out;
+    metrics.writeChromeTrace(out);
+    const std::string trace = out.str();
+    CHECK(trace.rfind("{\"displayTimeUnit\":\"ns\",\"otherData\":{\"run\":\"traced\"}", 0) == 0);
+    CHECK(trace.find("\"traceEvents\":[") != std::string::npos);
+    CHECK(trace.find("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":") != std::string::npos);
+    CHECK(trace.find("\"args\":{\"name\":\"helper\"}") != std::string::npos);
+    CHECK(trace.find("{\"name\":\"Helper Work\",\"cat\":\"trace\",\"ph\":\"X\"") != std::string::npos);
+    CHECK(trace.find("\"args\":{\"items\":42}") != std::string::npos);
+    CHECK(trace.substr(trace.size() - 3) == "]}\n");
+
+    // A traced run of processFileWithTiming writes its trace
+    auto inputPath = generateValidFile(text);
+    auto outputPath = generateValidFile("");
+    auto tracePath = generateValidFile("");
+    processFileWithTiming(inputPath, outputPath, ProcessingOptions{.useParallel = true, .tracePath = tracePath});
+    std::string written = readFile(tracePath);
+    CHECK(written.find("\"name\":\"Tree Construction\",\"cat\":\"stage\"") != std::string::npos);
+    CHECK(written.find("\"tokens\":") != std::string::npos);
+    for (const auto& path : {inputPath, outputPath, tracePath}) std::filesystem::remove(path);
+}
+
+// Test cases for the opt-in `AllocationTracker` hooks
+TEST_CASE("Allocation Tracking") {
+    if (!AllocationTracker::available()) return;  // Hooks not built in (RBTREE_TRACK_ALLOCATIONS)
+    auto escape = [](auto* p) {
+        doNotOptimize(p);  // Keeps the compiler from eliding the allocations
+        return p;
+    };
+
+    // Nothing is counted while tracking is disabled
+    CHECK_FALSE(AllocationTracker::enabled());
+    auto before = AllocationTracker::threadStats();
+    delete escape(new std::vector<int>(100));
+    CHECK(AllocationTracker::threadStats().allocations == before.allocations);
+
+    {
+        AllocationTrackingScope tracking;
+        CHECK(AllocationTracker::enabled());
+
+        // Every allocation and free is counted with the size of its block
+        before = AllocationTracker::threadStats();
+        auto* block = escape(new char[1000]);
+        auto allocated = AllocationTracker::threadStats() - before;
+        CHECK(allocated.allocations == 1);
+        CHECK(allocated.allocatedBytes >= 1000);
+        CHECK(allocated.liveBytes() == allocated.allocatedBytes);
+        delete[] block;
+        auto balanced = AllocationTracker::threadStats() - before;
+        CHECK(balanced.frees == 1);
+        CHECK(balanced.liveBytes() == 0);
+
+        // Over-aligned and nothrow forms too
+        before = AllocationTracker::threadStats();
+        struct alignas(256) Aligned { char bytes[256]; };
+        auto* aligned = escape(new Aligned);
+        CHECK(reinterpret_cast<std::uintptr_t>(aligned) % 256 == 0);
+        delete aligned;
+        delete escape(new (std::nothrow) int(1));
+        auto forms = AllocationTracker::threadStats() - before;
+        CHECK(forms.allocations == 2);
+        CHECK(forms.frees == 2);
+        CHECK(forms.liveBytes() == 0);
+
+        // Untracked allocations are not counted
+        before = AllocationTracker::threadStats();
+        {
+            UntrackedAllocations untracked;
+            delete escape(new int(2));
+        }
+        CHECK(AllocationTracker::threadStats().allocations == before.allocations);
+
+        // Allocations of other threads are in the totals, also after the threads finished
+        before = AllocationTracker::totalStats();
+        std::thread worker([&]() {
+            std::vector<std::string> words(50, std::string(40, 'x'));
+            escape(words.data());
+        });
+        worker.join();
+        CHECK(AllocationTracker::totalStats().allocations - before.allocations >= 51);
+
+        // Stage spans count the allocations of all threads, trace spans those of their own thread
+        Metrics metrics("allocations", true);
+        {
+            MetricsScope scope(metrics);
+            ScopedSpan stage("Stage");
+            std::vector<int> values = generateRandomIntegers(2000);
+            auto tree = parallelInsert<int>(values, 4);
+            stage.stop();
+            ScopedSpan quiet("Quiet", SpanLevel::Trace);
+        }
+        for (const auto& span : metrics.spans()) {
+            REQUIRE(span.allocations.has_value());
+            if (span.name == "Stage") CHECK(span.allocations->allocations >= 2000);  // At least one per node
+            if (span.name == "Quiet") CHECK(span.allocations->allocations == 0);
+        }
+        std::ostringstream json, summary;
+        metrics.writeJson(json);
+        metrics.printSummary(summary);
+        CHECK(json.str().find("\"allocations\":{\"count\":") != std::string::npos);
+        CHECK(summary.str().find(" allocations, ") != std::string::npos);
+    }
+    CHECK_FALSE(AllocationTracker::enabled());
+
+    // processFileWithTiming reports the allocations of the run
+    auto inputPath = generateValidFile(generateComplexRandomText(500));
+    auto outputPath = generateValidFile("");
+    auto metricsPath = generateValidFile("");
+    processFileWithTiming(inputPath, outputPath, ProcessingOptions{.metricsPath = metricsPath, .trackAllocations = true});
+    std::string written = readFile(metricsPath);
+    CHECK(written.find("\"allocated_bytes\":") != std::string::npos);
+    CHECK(written.find("\"Total Processing/Tree Construction\"") != std::string::npos);
+    CHECK(written.find("\"allocations\":{\"count\":") != std::string::npos);
+    for (const auto& path : {inputPath, outputPath, metricsPath}) std::filesystem::remove(path);
+}
+
+// Test cases for the `perf_event_open` counters `PerfCounters`
+TEST_CASE("Hardware Counters") {
+    // Readings only hold the events that could be opened, and explain the others
+    PerfCounters counters;
+    PerfReading start = counters.read();
+    bool allOpened = true;
+    for (size_t i = 0; i < perfEventCount; ++i) {
+        CHECK(start.valid[i] == counters.available(static_cast<PerfEvent>(i)));
+        allOpened = allOpened && start.valid[i];
+    }
+    CHECK(counters.available() == !start.empty());
+    CHECK(counters.error().empty() == allOpened);
+    CHECK(std::string(perfEventName(PerfEvent::LlcMisses)) == "llc_misses");
+
+    // Differences and quotients keep the events counted in both readings
+    PerfReading a, b;
+    a.valid = {true, true, false, false, false, false, true};
+    a.values = {1000, 2500, 0, 0, 0, 0, 8};
+    b.valid = {true, true, true, false, false, false, false};
+    b.values = {400, 1000, 5, 0, 0, 0, 0};
+    PerfReading difference = a - b;
+    CHECK(difference.has(PerfEvent::Cycles));
+    CHECK_FALSE(difference.has(PerfEvent::BranchMisses));
+    CHECK_FALSE(difference.has(PerfEvent::PageFaults));
+    CHECK(difference[PerfEvent::Instructions] == doctest::Approx(1500));
+    CHECK(difference.ipc().value() == doctest::Approx(2.5));
+    CHECK((difference / 100)[PerfEvent::Cycles] == doctest::Approx(6));
+    CHECK_FALSE(PerfReading{}.ipc().has_value());
+
+    // Touching fresh memory faults pages in, on this thread as on the others
+    if (counters.available(PerfEvent::PageFaults)) {
+        PerfReading before = counters.read();
+        std::thread toucher([]() {
+            std::vector<char> pages(16 << 20);
+            for (size_t i = 0; i < pages.size(); i += 4096) pages[i] = 1;
+        });
+        toucher.join();
+        std::vector<char> pages(16 << 20);
+        for (size_t i = 0; i < pages.size(); i += 4096) pages[i] = 1;
+        CHECK((counters.read() - before)[PerfEvent::PageFaults] > 0);  // Fewer with huge pages
+        CHECK_FALSE((counters.read() - before).partial);
+
+        // Readings are partial while a thread started after the counters were opened runs
+        std::atomic<bool> done{false};
+        std::thread runner([&]() {
+            while (!done.load()) std::this_thread::yield();
+        });
+        CHECK(counters.read().partial);
+        CHECK((counters.read() - before).partial);
+        done = true;
+        runner.join();
+        CHECK_FALSE(counters.read().partial);
+    }
+
+    // Stage spans of a registry with counters carry their counts, trace spans do not
+    Metrics metrics("counted", true);
+    metrics.setPerfCounters(&counters);
+    {
+        MetricsScope scope(metrics);
+        ScopedSpan stage("Stage");
+        ScopedSpan detail("Detail", SpanLevel::Trace);
+    }
+    for (const auto& span : metrics.spans()) {
+        CHECK(span.hardware.has_value() == (span.level == SpanLevel::Stage));
+    }
+
+    // processFileWithTiming runs whether or not the kernel allows counting
+    auto inputPath = generateValidFile(generateComplexRandomText(500));
+    auto outputPath = generateValidFile("");
+    auto metricsPath = generateValidFile("");
+    processFileWithTiming(inputPath, outputPath, ProcessingOptions{.metricsPath = metricsPath, .hardwareCounters = true});
+    std::string written = readFile(metricsPath);
+    CHECK(written.find("\"Total Processing/Tree Construction\"") != std::string::npos);
+    CHECK((written.find("\"hardware\":{") != std::string::npos) == counters.available());
+    for (const auto& path : {inputPath, outputPath, metricsPath}) std::filesystem::remove(path);
+}
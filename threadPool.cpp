@@ -0,0 +1,167 @@
+#include "threadPool.h"
+#include <algorithm>
+
+namespace {
+
+// Pool and worker index of the calling thread (nullptr for threads outside every pool)
+thread_local ThreadPool const *currentPool = nullptr;
+thread_local unsigned currentIndex = 0;
+
+// Requested size of the global pool (0: default), and whether it has been started
+std::atomic<unsigned> globalWorkers{0};
+std::atomic<bool> globalStarted{false};
+
+} // namespace
+
+ThreadPool::ThreadPool(unsigned workers) {
+    for (unsigned i = 0; i < workers; ++i) _workers.push_back(std::make_unique<Worker>());
+    for (unsigned i = 0; i < workers; ++i) _threads.emplace_back([this, i] { workerLoop(i); });
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> guard(_sleepLock);
+        _stopping.store(true);
+    }
+    _wake.notify_all();
+    for (auto &thread : _threads) thread.join();
+}
+
+unsigned ThreadPool::defaultWorkerCount() {
+    return std::max(std::thread::hardware_concurrency(), 2u) - 1;
+}
+
+ThreadPool &ThreadPool::global() {
+    static ThreadPool pool([] {
+        globalStarted.store(true);
+        unsigned workers = globalWorkers.load();
+        return workers ? workers : defaultWorkerCount();
+    }());
+    return pool;
+}
+
+bool ThreadPool::setGlobalWorkerCount(unsigned workers) {
+    if (globalStarted.load()) return false;
+    globalWorkers.store(workers);
+    return true;
+}
+
+int ThreadPool::currentWorker() const {
+    return currentPool == this ? static_cast<int>(currentIndex) : -1;
+}
+
+void ThreadPool::submit(Task *task) {
+    int self = currentWorker();
+    if (self >= 0) {
+        std::lock_guard<std::mutex> guard(_workers[self]->lock);
+        _workers[self]->tasks.push_back(task);
+    } else {
+        std::lock_guard<std::mutex> guard(_globalLock);
+        _global.push_back(task);
+    }
+    // Wake a sleeping worker. Sleepers register before checking _queued under _sleepLock, so
+    // either the sleeper sees the new task or this thread sees the sleeper (both are seq_cst).
+    _queued.fetch_add(1);
+    if (_sleepers.load() > 0) {
+        std::lock_guard<std::mutex> guard(_sleepLock);
+        _wake.notify_one();
+    }
+}
+
+ThreadPool::Task *ThreadPool::findTask() {
+    if (_queued.load(std::memory_order_relaxed) == 0) return nullptr; // Nothing anywhere
+    auto take = [this](Task *task) {
+        _queued.fetch_sub(1, std::memory_order_relaxed);
+        return task;
+    };
+
+    // Own deque, newest first
+    int self = currentWorker();
+    if (self >= 0) {
+        std::lock_guard<std::mutex> guard(_workers[self]->lock);
+        auto &tasks = _workers[self]->tasks;
+        if (!tasks.empty()) {
+            Task *task = tasks.back();
+            tasks.pop_back();
+            return take(task);
+        }
+    }
+
+    // Global injection queue, oldest first
+    {
+        std::lock_guard<std::mutex> guard(_globalLock);
+        if (!_global.empty()) {
+            Task *task = _global.front();
+            _global.pop_front();
+            return take(task);
+        }
+    }
+
+    // Steal the oldest task of another worker, starting with the next one
+    size_t count = _workers.size();
+    for (size_t k = 1; k <= count; ++k) {
+        size_t victim = (static_cast<size_t>(self >= 0 ? self : 0) + k) % count;
+        if (static_cast<int>(victim) == self) continue;
+        std::lock_guard<std::mutex> guard(_workers[victim]->lock);
+        auto &tasks = _workers[victim]->tasks;
+        if (!tasks.empty()) {
+            Task *task = tasks.front();
+            tasks.pop_front();
+            return take(task);
+        }
+    }
+    return nullptr;
+}
+
+void ThreadPool::wait(Task &task) {
+    constexpr int spinLimit = 64;
+    int spins = 0;
+    while (!task.done.load(std::memory_order_acquire)) {
+        if (Task *other = findTask()) {
+            other->run(other); // Help instead of blocking (often this is the awaited task itself)
+            spins = 0;
+        } else if (++spins < spinLimit) {
+            std::this_thread::yield(); // The task is running on another thread, maybe about to finish
+        } else {
+            // Sleep until it completes. Registering before checking done, both seq_cst, means either
+            // this thread sees done or complete sees the joiner and notifies under the lock.
+            std::unique_lock<std::mutex> guard(_joinLock);
+            _joiners.fetch_add(1);
+            _done.wait(guard, [&task] { return task.done.load(); });
+            _joiners.fetch_sub(1);
+        }
+    }
+}
+
+void ThreadPool::complete(Task &task) {
+    task.done.store(true);
+    if (_joiners.load() > 0) {
+        std::lock_guard<std::mutex> guard(_joinLock);
+        _done.notify_all();
+    }
+}
+
+void ThreadPool::workerLoop(unsigned index) {
+    currentPool = this;
+    currentIndex = index;
+    while (true) {
+        if (Task *task = findTask()) {
+            task->run(task);
+            continue;
+        }
+
+        // Nothing to do: spin briefly, then sleep until a task is submitted
+        bool found = false;
+        for (int spin = 0; spin < 64 && !found; ++spin) {
+            std::this_thread::yield();
+            found = _queued.load(std::memory_order_relaxed) > 0;
+        }
+        if (found) continue;
+
+        std::unique_lock<std::mutex> guard(_sleepLock);
+        _sleepers.fetch_add(1);
+        _wake.wait(guard, [this] { return _stopping.load() || _queued.load() > 0; });
+        _sleepers.fetch_sub(1);
+        if (_stopping.load()) return;
+    }
+}
@@ -0,0 +1,168 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "spanContext.h"
+
+// Work-stealing thread pool for fork-join parallelism
+// Every worker owns a deque: tasks forked by a worker go to the back of its own deque and are taken
+// back from there (newest first, while their data is still in cache), idle workers steal from the
+// front of other deques (oldest first, i.e. the largest pieces of work). Tasks forked by threads
+// outside the pool go to a global injection queue. A thread waiting for a forked task runs other
+// tasks meanwhile, and usually ends up running its own forked task when nobody stole it; once there
+// is nothing left to run, it spins briefly and then sleeps until the stolen task completes, so
+// that a joiner behind a long task does not hold a core.
+// Forked tasks live on the forking thread's stack, so forking does not allocate. The spans a task
+// opens nest in the span that was open where it was forked, not in whatever the thread that runs
+// it (a worker, or a thread stealing while it waits) has open.
+// Tasks are meant to compute, not to wait for other threads (e.g. on a queue or a lock held across
+// tasks): long-running blocking stages should keep their own threads.
+class ThreadPool {
+public:
+    // Constructor: starts the given number of worker threads (0 runs every task on the forking thread)
+    explicit ThreadPool(unsigned workers = defaultWorkerCount());
+
+    ThreadPool(ThreadPool const &) = delete;
+    ThreadPool &operator=(ThreadPool const &) = delete;
+
+    // Destructor: stops and joins the workers
+    ~ThreadPool();
+
+    // Number of worker threads
+    unsigned workerCount() const { return static_cast<unsigned>(_threads.size()); }
+
+    // One worker per hardware thread but one, which the forking thread takes (at least one worker)
+    static unsigned defaultWorkerCount();
+
+    // Pool shared by all parallel algorithms of the program, started on first use
+    static ThreadPool &global();
+
+    // Set the number of workers of the global pool; only possible before its first use
+    // Returns false if the global pool is already running
+    static bool setGlobalWorkerCount(unsigned workers);
+
+    // Run f and g, possibly in parallel, and return when both are done
+    // g is forked (made available to other workers) while the calling thread runs f.
+    // An exception thrown by either is rethrown here once both have finished.
+    template<typename F, typename G>
+    void parallelInvoke(F &&f, G &&g);
+
+    // Call body(i) for every i in [begin, end), possibly in parallel
+    // The range is split in halves recursively down to pieces of at most grain indices.
+    template<typename F>
+    void parallelFor(size_t begin, size_t end, size_t grain, F &&body);
+
+private:
+    // A unit of work; the concrete task (see parallelInvoke) provides run
+    struct Task {
+        void (*run)(Task *) = nullptr; // Runs the work, stores any exception, then calls complete
+        std::atomic<bool> done{false};
+        std::exception_ptr error;
+        ScopedSpan *span = SpanContext::current(); // Span open on the forking thread (see SpanContext)
+    };
+
+    // Per-worker deque, on its own cache line
+    struct alignas(64) Worker {
+        std::mutex lock;
+        std::deque<Task *> tasks;
+    };
+
+    // Make a task available: on the calling worker's deque, or on the global queue
+    void submit(Task *task);
+
+    // Take a task: own deque first, then the global queue, then steal from the other workers
+    Task *findTask();
+
+    // Run other tasks until the given one is done, then sleep until it is
+    void wait(Task &task);
+
+    // Mark a task done and wake the threads sleeping in wait (the task may be gone on return)
+    void complete(Task &task);
+
+    // Main loop of worker thread `index`
+    void workerLoop(unsigned index);
+
+    // Index of the calling thread among this pool's workers, or -1 for other threads
+    int currentWorker() const;
+
+    std::vector<std::unique_ptr<Worker>> _workers; // One deque per worker
+    std::mutex _globalLock;
+    std::deque<Task *> _global; // Tasks forked from outside the pool
+    std::atomic<size_t> _queued{0}; // Number of tasks waiting in any queue
+    std::atomic<unsigned> _sleepers{0}; // Number of workers waiting for _wake
+    std::mutex _sleepLock;
+    std::condition_variable _wake;
+    std::atomic<bool> _stopping{false};
+    std::atomic<unsigned> _joiners{0}; // Number of threads sleeping in wait for _done
+    std::mutex _joinLock;
+    std::condition_variable _done;
+    std::vector<std::thread> _threads;
+};
+
+template<typename F, typename G>
+void ThreadPool::parallelInvoke(F &&f, G &&g) {
+    // The forked task refers to g, which outlives it on this stack frame
+    struct Forked : Task {
+        std::remove_reference_t<G> *function;
+        ThreadPool *pool;
+    };
+    Forked forked;
+    forked.function = &g;
+    forked.pool = this;
+    forked.run = [](Task *task) {
+        auto *self = static_cast<Forked *>(task);
+        SpanContext::Nesting nesting(self->span); // The forking span stays open: parallelInvoke waits for g
+        try {
+            (*self->function)();
+        } catch (...) {
+            self->error = std::current_exception();
+        }
+        self->pool->complete(*self); // Last access: the owner may now return
+    };
+    submit(&forked);
+
+    try {
+        f();
+    } catch (...) {
+        wait(forked); // g still refers to this frame: let it finish before unwinding
+        throw;
+    }
+    wait(forked);
+    if (forked.error) std::rethrow_exception(forked.error);
+}
+
+template<typename F>
+void ThreadPool::parallelFor(size_t begin, size_t end, size_t grain, F &&body) {
+    if (grain == 0) grain = 1;
+    if (begin >= end || end - begin <= grain) {
+        for (size_t i = begin; i < end; ++i) body(i);
+        return;
+    }
+    size_t mid = begin + (end - begin) / 2;
+    parallelInvoke([&] { parallelFor(begin, mid, grain, body); },
+                   [&] { parallelFor(mid, end, grain, body); });
+}
+
+// Fork-join on the global pool (see ThreadPool::parallelInvoke)
+template<typename F, typename G>
+void parallelInvoke(F &&f, G &&g) {
+    ThreadPool::global().parallelInvoke(std::forward<F>(f), std::forward<G>(g));
+}
+
+// Parallel loop on the global pool (see ThreadPool::parallelFor)
+template<typename F>
+void parallelFor(size_t begin, size_t end, F &&body, size_t grain = 1) {
+    ThreadPool::global().parallelFor(begin, end, grain, std::forward<F>(body));
+}
+
+#endif // THREAD_POOL_H
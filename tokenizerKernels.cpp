@@ -0,0 +1,198 @@
+#include "tokenizerKernels.h"
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define TOKENIZER_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define TOKENIZER_X86_KERNELS 0
+#endif
+
+namespace {
+
+// Portable kernel: classify, lowercase and track the current word one byte at a time
+// The word spans [first, last) from its first to its last letter, which trims the apostrophes around it
+void scanWordsScalar(std::string_view text, char* out, std::vector<std::string_view>& words) {
+    size_t first = 0, last = 0; // Empty while no letter of the current word has been seen
+    for (size_t i = 0; i < text.size(); ++i) {
+        unsigned char c = static_cast<unsigned char>(text[i]);
+        if (isAsciiLetter(c)) {
+            out[i] = static_cast<char>(c | 0x20); // Lowercase
+            if (first == last) first = i;
+            last = i + 1;
+        } else {
+            out[i] = static_cast<char>(c);
+            if (c != '\'' && first != last) { // A separator ends the word
+                words.emplace_back(out + first, last - first);
+                first = last;
+            }
+        }
+    }
+    if (first != last) words.emplace_back(out + first, last - first); // Word at the end of the text
+}
+
+#if TOKENIZER_X86_KERNELS
+
+// Bit i of each mask describes byte i of a 64-byte block
+struct BlockMasks {
+    std::uint64_t letters;
+    std::uint64_t apostrophes;
+};
+
+// Mask of the bits strictly above bit p
+inline std::uint64_t bitsAbove(int p) {
+    return p >= 63 ? 0 : ~std::uint64_t{0} << (p + 1);
+}
+
+// Vector kernel shared by all instruction sets
+// Classify(in, out) lowercases one 64-byte block into out and returns its masks. Word boundaries
+// are then found from the masks with count-zero instructions, one step per word instead of per byte.
+// The tail is padded with spaces, which also ends a word running up to the end of the text.
+template<typename Classify>
+[[gnu::always_inline]] inline void scanBlocks(std::string_view text, char* out, std::vector<std::string_view>& words,
+                                              Classify classify) {
+    size_t first = 0, last = 0; // Current word, as in scanWordsScalar
+    bool inWord = false;
+
+    auto scanBlock = [&](size_t base, BlockMasks masks) {
+        std::uint64_t separators = ~(masks.letters | masks.apostrophes);
+        std::uint64_t live = ~std::uint64_t{0}; // Bits not consumed yet
+        while (true) {
+            if (!inWord) {
+                // Skip to the first letter of the next word
+                std::uint64_t letters = masks.letters & live;
+                if (!letters) return;
+                int p = std::countr_zero(letters);
+                first = base + p;
+                last = first + 1;
+                inWord = true;
+                live = bitsAbove(p);
+            } else {
+                // Extend the word up to the last letter before the next separator
+                std::uint64_t separator = separators & live;
+                std::uint64_t before = separator ? (separator & -separator) - 1 : ~std::uint64_t{0};
+                std::uint64_t letters = masks.letters & live & before;
+                if (letters) last = base + 64 - std::countl_zero(letters);
+                if (!separator) return; // The word continues in the next block
+                words.emplace_back(out + first, last - first);
+                inWord = false;
+                live = bitsAbove(std::countr_zero(separator));
+            }
+        }
+    };
+
+    size_t base = 0;
+    for (; base + 64 <= text.size(); base += 64) {
+        scanBlock(base, classify(text.data() + base, out + base));
+    }
+
+    // Tail block, always scanned so that the last word is closed
+    alignas(64) char padded[64];
+    alignas(64) char lowered[64];
+    size_t rest = text.size() - base;
+    std::memset(padded, ' ', sizeof(padded));
+    if (rest) std::memcpy(padded, text.data() + base, rest); // Empty text may have null data and out
+    BlockMasks masks = classify(padded, lowered);
+    if (rest) std::memcpy(out + base, lowered, rest);
+    scanBlock(base, masks);
+}
+
+// SSE2: letters are found with a signed compare after shifting 'a'..'z' to the bottom of the range
+__attribute__((target("sse2"))) inline BlockMasks classifySse2(char const* in, char* out) {
+    BlockMasks masks{0, 0};
+    for (int k = 0; k < 4; ++k) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(in + 16 * k));
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        __m128i letter = _mm_cmplt_epi8(_mm_add_epi8(lower, _mm_set1_epi8(0x80 - 'a')),
+                                        _mm_set1_epi8(static_cast<char>(0x80 + 26)));
+        __m128i quote = _mm_cmpeq_epi8(v, _mm_set1_epi8('\''));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 16 * k),
+                         _mm_or_si128(v, _mm_and_si128(letter, _mm_set1_epi8(0x20))));
+        masks.letters |= std::uint64_t{static_cast<std::uint16_t>(_mm_movemask_epi8(letter))} << (16 * k);
+        masks.apostrophes |= std::uint64_t{static_cast<std::uint16_t>(_mm_movemask_epi8(quote))} << (16 * k);
+    }
+    return masks;
+}
+
+__attribute__((target("sse2"))) void scanWordsSse2(std::string_view text, char* out,
+                                                   std::vector<std::string_view>& words) {
+    scanBlocks(text, out, words, classifySse2);
+}
+
+// AVX2: the same classification on 32 bytes at a time
+__attribute__((target("avx2"))) inline BlockMasks classifyAvx2(char const* in, char* out) {
+    BlockMasks masks{0, 0};
+    for (int k = 0; k < 2; ++k) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(in + 32 * k));
+        __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        __m256i letter = _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(0x80 + 26)),
+                                           _mm256_add_epi8(lower, _mm256_set1_epi8(0x80 - 'a')));
+        __m256i quote = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\''));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 32 * k),
+                            _mm256_or_si256(v, _mm256_and_si256(letter, _mm256_set1_epi8(0x20))));
+        masks.letters |= std::uint64_t{static_cast<std::uint32_t>(_mm256_movemask_epi8(letter))} << (32 * k);
+        masks.apostrophes |= std::uint64_t{static_cast<std::uint32_t>(_mm256_movemask_epi8(quote))} << (32 * k);
+    }
+    return masks;
+}
+
+__attribute__((target("avx2"))) void scanWordsAvx2(std::string_view text, char* out,
+                                                   std::vector<std::string_view>& words) {
+    scanBlocks(text, out, words, classifyAvx2);
+}
+
+// AVX-512BW: unsigned compares produce the 64-bit masks directly, and a masked move lowercases
+__attribute__((target("avx512f,avx512bw"))) inline BlockMasks classifyAvx512(char const* in, char* out) {
+    __m512i v = _mm512_loadu_si512(in);
+    __m512i lower = _mm512_or_si512(v, _mm512_set1_epi8(0x20));
+    __mmask64 letter = _mm512_cmplt_epu8_mask(_mm512_sub_epi8(lower, _mm512_set1_epi8('a')), _mm512_set1_epi8(26));
+    _mm512_storeu_si512(out, _mm512_mask_mov_epi8(v, letter, lower));
+    return {letter, _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\''))};
+}
+
+__attribute__((target("avx512f,avx512bw"))) void scanWordsAvx512(std::string_view text, char* out,
+                                                                 std::vector<std::string_view>& words) {
+    scanBlocks(text, out, words, classifyAvx512);
+}
+
+#endif // TOKENIZER_X86_KERNELS
+
+} // namespace
+
+// Detect the best level once; the CPU checks also verify that the OS saves the vector registers
+SimdLevel detectSimdLevel() {
+#if TOKENIZER_X86_KERNELS
+    static const SimdLevel level = []() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512bw")) return SimdLevel::AVX512;
+        if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+        return SimdLevel::SSE2; // Part of the x86-64 baseline
+    }();
+    return level;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+std::string_view simdLevelName(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::SSE2: return "sse2";
+        case SimdLevel::AVX2: return "avx2";
+        case SimdLevel::AVX512: return "avx512";
+        default: return "scalar";
+    }
+}
+
+void scanWords(std::string_view text, char* out, std::vector<std::string_view>& words, SimdLevel level) {
+    switch (std::min(level, detectSimdLevel())) {
+#if TOKENIZER_X86_KERNELS
+        case SimdLevel::AVX512: return scanWordsAvx512(text, out, words);
+        case SimdLevel::AVX2: return scanWordsAvx2(text, out, words);
+        case SimdLevel::SSE2: return scanWordsSse2(text, out, words);
+#endif
+        default: return scanWordsScalar(text, out, words);
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef TOKENIZER_KERNELS_H
+#define TOKENIZER_KERNELS_H
+
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+// Instruction set levels of the word scanning kernel, from the portable fallback upwards
+// Every level produces exactly the same buffer and words.
+enum class SimdLevel {
+    Scalar, // One byte at a time
+    SSE2, // 16 bytes per instruction
+    AVX2, // 32 bytes per instruction
+    AVX512 // 64 bytes per instruction (AVX-512BW)
+};
+
+// Letters as classified by std::isalpha in the default "C" locale
+inline bool isAsciiLetter(unsigned char c) {
+    return static_cast<unsigned char>((c | 0x20) - 'a') < 26;
+}
+
+// Best level supported by the CPU (and compiler) the program runs on, detected once
+SimdLevel detectSimdLevel();
+
+// Printable name of a level ("scalar", "sse2", "avx2", "avx512")
+std::string_view simdLevelName(SimdLevel level);
+
+// Copy text to out with ASCII letters lowercased, and append every word as a view into out
+// A word is a run of letters and apostrophes with its leading and trailing apostrophes removed;
+// letters are those of std::isalpha in the default "C" locale. Levels above detectSimdLevel()
+// fall back to the best supported one. out must hold text.size() bytes.
+void scanWords(std::string_view text, char* out, std::vector<std::string_view>& words, SimdLevel level);
+
+#endif // TOKENIZER_KERNELS_H